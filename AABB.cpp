@@ -3,70 +3,921 @@
 #include <array>
 #include<glm/glm.hpp>
 #include <memory>
+#include <cmath>
 #include <hpp/AABB.hpp>
+#include "hpp/raycast.hpp"
+#include "hpp/thread_pool.hpp"
 
 
-// Prints the first triangle of each leaf node in the tree
-void AABBTree::print(std::unique_ptr<AABBNode>& node) const
+// Splits the AABB into two halves along the given axis
+std::pair<AABB, AABB> AABB::split(unsigned axis) const
+{
+    float mid_point = (min_corner[axis] + max_corner[axis]) * 0.5f;
+    std::cout << mid_point << "mid \n";
+
+    glm::vec3 first_max{max_corner};
+    first_max[axis] = mid_point;
+
+    glm::vec3 second_min{min_corner};
+    second_min[axis] = mid_point;
+
+    return {
+        AABB(min_corner, first_max),
+        AABB(second_min, max_corner)
+    };
+}
+
+// Computes the AABB that encloses all the mesh's vertices
+void Mesh::updateAABB()
 {
-    if(node==nullptr) {return;}
-    if(!node->isLeaf())
+    glm::vec3 min{coordinates[0]};
+    glm::vec3 max{coordinates[0]};
+
+    for(const auto& coord: coordinates)
     {
-        print(node->left_child);
-        print(node->right_child);
+        min = glm::min(min, coord);
+        max = glm::max(max, coord);
     }
 
-    auto triangle = node->mesh.triangles[0];
-    for(auto t:triangle)
+    aabb = {min, max};
+}
+
+// Prints the first triangle of each leaf node in the tree
+void AABBTree::print() const
+{
+    for(const LinearNode& node : nodes)
     {
-        std::cout << node->mesh.coordinates[t][0] << ", ";
-        std::cout << node->mesh.coordinates[t][1] << ", ";
-        std::cout << node->mesh.coordinates[t][2] << "\n";
+        if(!node.isLeaf()) { continue; }
+
+        auto triangle = mesh.triangles[blocks[node.offset].triangle[0]];
+        for(auto t:triangle)
+        {
+            std::cout << mesh.coordinates[t][0] << ", ";
+            std::cout << mesh.coordinates[t][1] << ", ";
+            std::cout << mesh.coordinates[t][2] << "\n";
+        }
+        std::cout << '\n';
     }
-    std::cout << '\n';
 }
 
-// Creates the root node of the AABB tree
-AABBTree::AABBTree(const Mesh& mesh)
+// Keeps a single copy of the mesh and creates the root node over all triangles
+AABBTree::AABBTree(const Mesh& mesh, BuildStrategy strategy, unsigned max_leaf_size):
+    mesh{mesh},
+    strategy{strategy},
+    max_leaf_size{max_leaf_size}
 {
-    root = std::make_unique<AABBNode>(mesh);
+    indices.resize(this->mesh.triangles.size());
+    for(unsigned i = 0; i < indices.size(); ++i) indices[i] = i;
+    root = std::make_unique<AABBNode>(0u, static_cast<unsigned>(indices.size()));
 }
 
-// Builds the AABB tree and prints its structure
+// Builds the AABB tree
 void AABBTree::build()
 {
-    build(root);
-    print(root);
+    nodes.clear();
+    blocks.clear();
+    built_quality.clear();
+    if(mesh.triangles.empty()) { root.reset(); return; } // Queries on an empty tree find nothing
+
+    // Bounds and centroids are computed once per triangle, not once per node
+    std::vector<AABB> triangle_bounds(mesh.triangles.size());
+    std::vector<glm::vec3> centroids(mesh.triangles.size());
+    for(size_t i = 0; i < mesh.triangles.size(); ++i)
+    {
+        const auto& tri = mesh.triangles[i];
+        const glm::vec3& v0 = mesh.coordinates[tri[0]];
+        const glm::vec3& v1 = mesh.coordinates[tri[1]];
+        const glm::vec3& v2 = mesh.coordinates[tri[2]];
+        triangle_bounds[i] = AABB(glm::min(v0, glm::min(v1, v2)), glm::max(v0, glm::max(v1, v2)));
+        centroids[i] = (v0 + v1 + v2) / 3.0f;
+    }
+
+    build(root, triangle_bounds, centroids, 0);
+
+    // Traversal only reads the flat array, the pointer tree is not needed anymore
+    flatten(root.get());
+    root.reset();
+    subtreeQuality(built_quality);
     std::cout << "[ OK ] Build AABB tree\n";
 }
 
+
+// Number of buckets the centroids are binned into per axis
+static constexpr int SAH_BINS = 16;
+// Cost of visiting an interior node, relative to one ray-triangle test
+static constexpr float SAH_TRAVERSAL_COST = 1.0f;
+// Past this depth SAH falls back to median splits, which keeps the tree
+// shallow enough for the fixed traversal stacks even on degenerate input
+static constexpr unsigned SAH_MAX_DEPTH = 40;
+
 // Recursively builds the AABB tree
-void AABBTree::build(std::unique_ptr<AABBNode>& node)
+void AABBTree::build(std::unique_ptr<AABBNode>& node,
+                     const std::vector<AABB>& triangle_bounds,
+                     const std::vector<glm::vec3>& centroids,
+                     unsigned depth)
 {
     if(node == nullptr) { return; }
     if(node->isLeaf() ) { return; }
+    if(node->size() == 0) { node->makeLeaf(); return; }
+
+    // Bounds tight to the triangles of this node only
+    node->aabb = AABB::empty();
+    for(unsigned i = node->begin; i < node->end; ++i)
+    {
+        node->aabb.expand(triangle_bounds[indices[i]]);
+    }
 
     // Stop recursion if there is only one triangle
-    if(node->mesh.triangles.size() == 1)
+    if(node->size() == 1)
     {
         node->makeLeaf();
         return;
     }
 
-    // Determine the longest axis of the current AABB
-    unsigned short largests_axis = node->mesh.aabb.getLargestAxis();
+    unsigned middle = node->begin;
+    if(strategy == BuildStrategy::SAH && depth < SAH_MAX_DEPTH)
+    {
+        if(!splitSAH(*node, triangle_bounds, centroids, middle))
+        {
+            node->makeLeaf();
+            return;
+        }
+    }
 
-    // Sort triangles along that axis
-    node->mesh.sortTrianglesByAxis(largests_axis);
+    // Median split, also the fallback when SAH cannot separate the centroids
+    if(middle == node->begin || middle == node->end)
+    {
+        // Determine the longest axis of the current AABB
+        unsigned short largests_axis = node->aabb.getLargestAxis();
 
-    // Split the mesh into two
-    auto sub_meshes = node->mesh.splitMesh();
+        // Partition the index range around the centroid median along that axis.
+        // Only the order matters for a median split, so no full sort is needed
+        middle = node->begin + node->size() / 2;
+        std::nth_element(indices.begin() + node->begin,
+                         indices.begin() + middle,
+                         indices.begin() + node->end,
+                         [&](unsigned a, unsigned b)
+                         { return centroids[a][largests_axis] < centroids[b][largests_axis]; });
+    }
 
-    // Create child nodes
-    node->left_child = std::make_unique<AABBNode>(sub_meshes.first);
-    node->right_child = std::make_unique<AABBNode>(sub_meshes.second);
+    // Create child nodes over the two halves of the range
+    node->left_child = std::make_unique<AABBNode>(node->begin, middle);
+    node->right_child = std::make_unique<AABBNode>(middle, node->end);
 
     // Recurse
-    build(node->left_child);
-    build(node->right_child);
+    build(node->left_child, triangle_bounds, centroids, depth + 1);
+    build(node->right_child, triangle_bounds, centroids, depth + 1);
+}
+
+// Bins the node's centroids along each axis and evaluates the SAH cost of
+// every bin boundary. On success the range is partitioned at middle
+bool AABBTree::splitSAH(AABBNode& node,
+                        const std::vector<AABB>& triangle_bounds,
+                        const std::vector<glm::vec3>& centroids,
+                        unsigned& middle)
+{
+    AABB centroid_bounds = AABB::empty();
+    for(unsigned i = node.begin; i < node.end; ++i)
+    {
+        centroid_bounds.expand(centroids[indices[i]]);
+    }
+
+    float node_area = node.aabb.surfaceArea();
+    float best_cost = std::numeric_limits<float>::max();
+    int best_axis = -1;
+    int best_bin = 0;
+
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        float extent = centroid_bounds.max_corner[axis] - centroid_bounds.min_corner[axis];
+        if(extent <= 0.0f) { continue; } // Every centroid in the same plane
+
+        AABB bin_bounds[SAH_BINS];
+        unsigned bin_count[SAH_BINS] = {};
+        for(int b = 0; b < SAH_BINS; ++b) { bin_bounds[b] = AABB::empty(); }
+
+        float scale = SAH_BINS / extent;
+        for(unsigned i = node.begin; i < node.end; ++i)
+        {
+            unsigned t = indices[i];
+            int b = static_cast<int>((centroids[t][axis] - centroid_bounds.min_corner[axis]) * scale);
+            b = std::min(b, SAH_BINS - 1);
+            bin_bounds[b].expand(triangle_bounds[t]);
+            ++bin_count[b];
+        }
+
+        // Sweep from the right to get the area and count on the right of each boundary
+        float right_area[SAH_BINS];
+        unsigned right_count[SAH_BINS];
+        AABB right = AABB::empty();
+        unsigned count = 0;
+        for(int b = SAH_BINS - 1; b > 0; --b)
+        {
+            right.expand(bin_bounds[b]);
+            count += bin_count[b];
+            right_area[b] = right.surfaceArea();
+            right_count[b] = count;
+        }
+
+        // Sweep from the left and evaluate the split between bins b - 1 and b
+        AABB left = AABB::empty();
+        count = 0;
+        for(int b = 1; b < SAH_BINS; ++b)
+        {
+            left.expand(bin_bounds[b - 1]);
+            count += bin_count[b - 1];
+            if(count == 0 || right_count[b] == 0) { continue; }
+
+            float cost = SAH_TRAVERSAL_COST
+                       + (left.surfaceArea() * count + right_area[b] * right_count[b]) / node_area;
+            if(cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    // Intersecting every triangle costs one test each
+    float leaf_cost = static_cast<float>(node.size());
+    if(best_axis < 0 || (node.size() <= max_leaf_size && leaf_cost <= best_cost))
+    {
+        // No split is possible: a leaf, unless it is too big and needs a median split
+        if(best_axis < 0 && node.size() > max_leaf_size)
+        {
+            middle = node.begin;
+            return true;
+        }
+        return false;
+    }
+
+    float min = centroid_bounds.min_corner[best_axis];
+    float scale = SAH_BINS / (centroid_bounds.max_corner[best_axis] - min);
+    auto split = std::partition(indices.begin() + node.begin, indices.begin() + node.end,
+                                [&](unsigned t)
+                                {
+                                    int b = static_cast<int>((centroids[t][best_axis] - min) * scale);
+                                    return std::min(b, SAH_BINS - 1) < best_bin;
+                                });
+    middle = static_cast<unsigned>(split - indices.begin());
+    return true;
+}
+
+// Writes the node and then its subtrees in depth-first order
+unsigned AABBTree::flatten(const AABBNode* node)
+{
+    unsigned index = static_cast<unsigned>(nodes.size());
+    nodes.emplace_back();
+    nodes[index].min_corner = node->aabb.min_corner;
+    nodes[index].max_corner = node->aabb.max_corner;
+
+    if(node->isLeaf())
+    {
+        // Repack the leaf triangles into SIMD blocks so a leaf visit tests them all at once
+        nodes[index].offset = static_cast<unsigned>(blocks.size());
+        nodes[index].count = node->size();
+        for(unsigned i = node->begin; i < node->end; ++i)
+        {
+            if((i - node->begin) % SIMD_WIDTH == 0) { blocks.emplace_back(); }
+            const auto& tri = mesh.triangles[indices[i]];
+            blocks.back().push(mesh.coordinates[tri[0]],
+                               mesh.coordinates[tri[1]],
+                               mesh.coordinates[tri[2]], indices[i]);
+        }
+        return index;
+    }
+
+    flatten(node->left_child.get()); // Lands at index + 1
+    unsigned second = flatten(node->right_child.get());
+    nodes[index].offset = second; // nodes may have grown, so index again
+    return index;
+}
+
+// Walks the flat tree and accumulates the SAH cost, depth and leaf sizes
+TreeQuality AABBTree::quality() const
+{
+    TreeQuality report;
+    if(nodes.empty()) { return report; }
+
+    float root_area = nodes[0].bounds().surfaceArea();
+    if(root_area <= 0.0f) { root_area = 1.0f; }
+
+    std::vector<std::pair<unsigned, unsigned>> stack{{0u, 1u}}; // Node and its depth
+    while(!stack.empty())
+    {
+        auto [index, depth] = stack.back();
+        stack.pop_back();
+        const LinearNode& node = nodes[index];
+
+        ++report.node_count;
+        report.depth = std::max(report.depth, depth);
+        float area_ratio = node.bounds().surfaceArea() / root_area;
+
+        if(node.isLeaf())
+        {
+            ++report.leaf_count;
+            ++report.leaf_sizes[node.count];
+            report.sah_cost += area_ratio * node.count;
+            continue;
+        }
+
+        report.sah_cost += area_ratio * SAH_TRAVERSAL_COST;
+        stack.push_back({node.offset, depth + 1});
+        stack.push_back({index + 1, depth + 1});
+    }
+    return report;
+}
+
+// Nodes per task of the thread pool when refitting the leaves
+static constexpr size_t REFIT_GRAIN = 4096;
+
+// Cost of each subtree as in quality(), but divided by the subtree's own area
+// instead of the root's: moving or scaling the whole subtree leaves it alone,
+// only boxes that overlap more than they used to make it grow
+void AABBTree::subtreeQuality(std::vector<float>& result)
+{
+    std::vector<float>& cost = subtree_cost;
+    cost.resize(nodes.size());
+    result.resize(nodes.size());
+    for(size_t n = nodes.size(); n-- > 0;)
+    {
+        const LinearNode& node = nodes[n];
+        float area = node.bounds().surfaceArea();
+        if(node.isLeaf()) { cost[n] = area * node.count; }
+        else { cost[n] = area * SAH_TRAVERSAL_COST + cost[n + 1] + cost[node.offset]; }
+        result[n] = area > 0.0f ? cost[n] / area : 0.0f;
+    }
+}
+
+// Leaves are independent and hold all the per-triangle work, so they are
+// refit in parallel. Children are always stored after their parent, so walking
+// the array backwards then updates both children before the node that encloses them
+void AABBTree::refit(const Mesh::coordinate_t& coordinates)
+{
+    mesh.coordinates = coordinates;
+    if(nodes.empty()) { return; }
+    mesh.updateAABB();
+
+    parallelFor(nodes.size(), REFIT_GRAIN, [&](size_t begin, size_t end)
+    {
+        for(size_t n = begin; n < end; ++n)
+        {
+            LinearNode& node = nodes[n];
+            if(!node.isLeaf()) { continue; }
+
+            AABB box = AABB::empty();
+            for(unsigned i = 0; i < node.count; ++i)
+            {
+                TriangleBlock& block = blocks[node.offset + i / SIMD_WIDTH];
+                unsigned lane = i % SIMD_WIDTH;
+                const auto& tri = mesh.triangles[block.triangle[lane]];
+                const glm::vec3& v0 = mesh.coordinates[tri[0]];
+                const glm::vec3& v1 = mesh.coordinates[tri[1]];
+                const glm::vec3& v2 = mesh.coordinates[tri[2]];
+                block.set(lane, v0, v1, v2);
+                box.expand(v0);
+                box.expand(v1);
+                box.expand(v2);
+            }
+            node.min_corner = box.min_corner;
+            node.max_corner = box.max_corner;
+        }
+    });
+
+    for(size_t n = nodes.size(); n-- > 0;)
+    {
+        LinearNode& node = nodes[n];
+        if(node.isLeaf()) { continue; }
+        AABB box = nodes[n + 1].bounds();
+        box.expand(nodes[node.offset].bounds());
+        node.min_corner = box.min_corner;
+        node.max_corner = box.max_corner;
+    }
+}
+
+// Number of flat nodes and SIMD blocks flatten() will write for the subtree
+static void countFlat(const AABBNode* node, unsigned& node_count, unsigned& block_count)
+{
+    ++node_count;
+    if(node->isLeaf())
+    {
+        block_count += (node->size() + SIMD_WIDTH - 1) / SIMD_WIDTH;
+        return;
+    }
+    countFlat(node->left_child.get(), node_count, block_count);
+    countFlat(node->right_child.get(), node_count, block_count);
+}
+
+// The array is in depth-first order, so a node's triangles come after those of
+// every leaf stored before it and its subtree is one contiguous run of nodes
+// and blocks. The degraded subtrees are rebuilt first; then the arrays are
+// written again in one pass, copying the untouched runs and flattening each
+// new subtree where the old one was
+unsigned AABBTree::update(const Mesh::coordinate_t& coordinates, float max_degradation)
+{
+    refit(coordinates);
+    if(nodes.empty()) { return 0; }
+
+    struct Candidate
+    {
+        unsigned node, node_end;             // Old nodes [node, node_end)
+        unsigned block_begin, block_end;     // Old blocks
+        unsigned first_triangle, triangle_count;
+        unsigned depth;
+        unsigned new_nodes{0}, new_blocks{0};
+        std::unique_ptr<AABBNode> subtree;
+    };
+    std::vector<Candidate> candidates;
+
+    std::vector<float>& current = current_quality;
+    std::vector<unsigned>& depth = node_depth;
+    subtreeQuality(current);
+    depth.assign(nodes.size(), 0);
+    unsigned triangles_before = 0;
+    unsigned skip_until = 0; // Inside a subtree that is already a candidate
+    for(unsigned n = 0; n < nodes.size(); ++n)
+    {
+        const LinearNode& node = nodes[n];
+        if(node.isLeaf())
+        {
+            triangles_before += node.count;
+            continue;
+        }
+        depth[n + 1] = depth[node.offset] = depth[n] + 1;
+        if(n < skip_until) { continue; }
+
+        if(built_quality[n] > 0.0f && current[n] > max_degradation * built_quality[n])
+        {
+            Candidate candidate;
+            candidate.node = n;
+            candidate.node_end = subtreeEnd(n);
+            unsigned first_leaf = n;
+            while(!nodes[first_leaf].isLeaf()) { ++first_leaf; }
+            const LinearNode& last_leaf = nodes[candidate.node_end - 1];
+            candidate.block_begin = nodes[first_leaf].offset;
+            candidate.block_end = last_leaf.offset + (last_leaf.count + SIMD_WIDTH - 1) / SIMD_WIDTH;
+            candidate.first_triangle = triangles_before;
+            candidate.triangle_count = 0;
+            for(unsigned b = candidate.block_begin; b < candidate.block_end; ++b)
+            {
+                candidate.triangle_count += blocks[b].count;
+            }
+            candidate.depth = depth[n];
+            candidates.push_back(std::move(candidate));
+            skip_until = candidates.back().node_end;
+        }
+    }
+    if(candidates.empty()) { return 0; }
+
+    // The builder reads bounds and centroids by triangle, only the candidates' are filled
+    std::vector<AABB> triangle_bounds(mesh.triangles.size());
+    std::vector<glm::vec3> centroids(mesh.triangles.size());
+    for(Candidate& candidate : candidates)
+    {
+        unsigned end = candidate.first_triangle + candidate.triangle_count;
+        for(unsigned i = candidate.first_triangle; i < end; ++i)
+        {
+            const auto& tri = mesh.triangles[indices[i]];
+            const glm::vec3& v0 = mesh.coordinates[tri[0]];
+            const glm::vec3& v1 = mesh.coordinates[tri[1]];
+            const glm::vec3& v2 = mesh.coordinates[tri[2]];
+            triangle_bounds[indices[i]] = AABB(glm::min(v0, glm::min(v1, v2)), glm::max(v0, glm::max(v1, v2)));
+            centroids[indices[i]] = (v0 + v1 + v2) / 3.0f;
+        }
+        candidate.subtree = std::make_unique<AABBNode>(candidate.first_triangle, end);
+        build(candidate.subtree, triangle_bounds, centroids, candidate.depth);
+        countFlat(candidate.subtree.get(), candidate.new_nodes, candidate.new_blocks);
+    }
+
+    // Where an untouched node or block moves: its old index plus the growth of
+    // every candidate that ends before it (offsets never point inside a candidate).
+    // Sums are modulo 2^32, since a subtree may also shrink
+    std::vector<unsigned> node_ends, block_ends;
+    std::vector<unsigned> node_shift{0}, block_shift{0};
+    for(const Candidate& candidate : candidates)
+    {
+        node_ends.push_back(candidate.node_end);
+        block_ends.push_back(candidate.block_end);
+        node_shift.push_back(node_shift.back() + candidate.new_nodes - (candidate.node_end - candidate.node));
+        block_shift.push_back(block_shift.back() + candidate.new_blocks - (candidate.block_end - candidate.block_begin));
+    }
+    auto moved = [](unsigned old_index, const std::vector<unsigned>& ends, const std::vector<unsigned>& shift)
+    {
+        size_t before = std::upper_bound(ends.begin(), ends.end(), old_index) - ends.begin();
+        return old_index + shift[before];
+    };
+
+    std::vector<LinearNode> old_nodes = std::move(nodes);
+    std::vector<TriangleBlock> old_blocks = std::move(blocks);
+    std::vector<float> old_quality = std::move(built_quality);
+    nodes.clear();
+    blocks.clear();
+    built_quality.clear();
+
+    auto copyNodes = [&](unsigned begin, unsigned end)
+    {
+        for(unsigned n = begin; n < end; ++n)
+        {
+            LinearNode node = old_nodes[n];
+            node.offset = node.isLeaf() ? moved(node.offset, block_ends, block_shift)
+                                        : moved(node.offset, node_ends, node_shift);
+            nodes.push_back(node);
+            built_quality.push_back(old_quality[n]);
+        }
+    };
+
+    unsigned next_node = 0, next_block = 0;
+    for(Candidate& candidate : candidates)
+    {
+        copyNodes(next_node, candidate.node);
+        blocks.insert(blocks.end(), old_blocks.begin() + next_block, old_blocks.begin() + candidate.block_begin);
+        flatten(candidate.subtree.get()); // Offsets come out final, the arrays are already in place
+        built_quality.resize(nodes.size(), 0.0f);
+        next_node = candidate.node_end;
+        next_block = candidate.block_end;
+    }
+    copyNodes(next_node, static_cast<unsigned>(old_nodes.size()));
+    blocks.insert(blocks.end(), old_blocks.begin() + next_block, old_blocks.end());
+
+    // Rebuilt nodes start over from their new quality, the rest keep their baseline
+    subtreeQuality(current);
+    for(const Candidate& candidate : candidates)
+    {
+        unsigned begin = moved(candidate.node, node_ends, node_shift);
+        for(unsigned n = begin; n < begin + candidate.new_nodes; ++n) { built_quality[n] = current[n]; }
+    }
+    return static_cast<unsigned>(candidates.size());
+}
+
+unsigned AABBTree::subtreeEnd(unsigned index) const
+{
+    while(!nodes[index].isLeaf()) { index = nodes[index].offset; } // Last leaf: always the second child
+    return index + 1;
+}
+
+// Maximum depth of the traversal stacks. A median split over 2^32 triangles
+// has depth 32, and SAH switches to median splits after SAH_MAX_DEPTH levels
+static constexpr int TRAVERSAL_STACK_SIZE = SAH_MAX_DEPTH + 34;
+
+// Finds the closest triangle hit by the ray.
+// Children are visited front-to-back and boxes farther than the closest hit are skipped
+bool AABBTree::intersect(const glm::vec3& origin, const glm::vec3& dir,
+                         RayHit& hit, float t_max) const
+{
+    if(nodes.empty()) { return false; }
+
+    // Division by a zero component gives +-inf, which the slab test handles
+    glm::vec3 inv_dir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+
+    float t_near;
+    if(!nodes[0].bounds().intersectRay(origin, inv_dir, t_max, t_near)) { return false; }
+
+    bool found = false;
+    hit.t = t_max;
+
+    // Nodes waiting to be visited, with the distance at which the ray enters them
+    unsigned stack[TRAVERSAL_STACK_SIZE];
+    float stack_t[TRAVERSAL_STACK_SIZE];
+    int top = 0;
+    stack[top] = 0;
+    stack_t[top] = t_near;
+    ++top;
+
+    while(top > 0)
+    {
+        --top;
+        if(stack_t[top] > hit.t) { continue; } // A closer hit was found meanwhile
+        const LinearNode& node = nodes[stack[top]];
+
+        if(node.isLeaf())
+        {
+            unsigned block_count = (node.count + SIMD_WIDTH - 1) / SIMD_WIDTH;
+            for(unsigned b = node.offset; b < node.offset + block_count; ++b)
+            {
+                float t, u, v;
+                int lane = rayTriangleBlockIntersect(origin, dir, blocks[b], hit.t, t, u, v);
+                if(lane >= 0)
+                {
+                    hit = {t, u, v, mesh.ids[blocks[b].triangle[lane]]};
+                    found = true;
+                }
+            }
+            continue;
+        }
+
+        unsigned first = stack[top] + 1;
+        unsigned second = node.offset;
+
+        float t_first, t_second;
+        bool hit_first = nodes[first].bounds().intersectRay(origin, inv_dir, hit.t, t_first);
+        bool hit_second = nodes[second].bounds().intersectRay(origin, inv_dir, hit.t, t_second);
+
+        // Push the farther child first so the nearer one is popped next
+        if(hit_first && hit_second && t_second < t_first)
+        {
+            std::swap(first, second);
+            std::swap(t_first, t_second);
+        }
+        if(hit_second)
+        {
+            stack[top] = second;
+            stack_t[top] = t_second;
+            ++top;
+        }
+        if(hit_first)
+        {
+            stack[top] = first;
+            stack_t[top] = t_first;
+            ++top;
+        }
+    }
+    return found;
+}
+
+// Collects the triangles whose bounds overlap box
+void AABBTree::query(const AABB& box, std::vector<unsigned>& out) const
+{
+    if(nodes.empty()) { return; }
+
+    unsigned stack[TRAVERSAL_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+
+    while(top > 0)
+    {
+        const LinearNode& node = nodes[stack[--top]];
+        if(!node.bounds().overlaps(box)) { continue; }
+
+        if(node.isLeaf())
+        {
+            for(unsigned i = 0; i < node.count; ++i)
+            {
+                unsigned triangle = blocks[node.offset + i / SIMD_WIDTH].triangle[i % SIMD_WIDTH];
+                const auto& tri = mesh.triangles[triangle];
+                const glm::vec3& v0 = mesh.coordinates[tri[0]];
+                const glm::vec3& v1 = mesh.coordinates[tri[1]];
+                const glm::vec3& v2 = mesh.coordinates[tri[2]];
+                AABB triangle_box(glm::min(v0, glm::min(v1, v2)), glm::max(v0, glm::max(v1, v2)));
+                if(triangle_box.overlaps(box)) { out.push_back(mesh.ids[triangle]); }
+            }
+            continue;
+        }
+
+        unsigned self = static_cast<unsigned>(&node - nodes.data());
+        stack[top++] = node.offset;
+        stack[top++] = self + 1;
+    }
+}
+
+// Finds the Voronoi region of p: a vertex, an edge or the face (Ericson, 5.1.5)
+glm::vec3 closestPointOnTriangle(const glm::vec3& p, const glm::vec3& v0,
+                                 const glm::vec3& e1, const glm::vec3& e2)
+{
+    glm::vec3 ap = p - v0;
+    float d1 = glm::dot(e1, ap);
+    float d2 = glm::dot(e2, ap);
+    if(d1 <= 0.0f && d2 <= 0.0f) { return v0; }
+
+    glm::vec3 bp = ap - e1;
+    float d3 = glm::dot(e1, bp);
+    float d4 = glm::dot(e2, bp);
+    if(d3 >= 0.0f && d4 <= d3) { return v0 + e1; }
+
+    float vc = d1 * d4 - d3 * d2;
+    if(vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) { return v0 + e1 * (d1 / (d1 - d3)); }
+
+    glm::vec3 cp = ap - e2;
+    float d5 = glm::dot(e1, cp);
+    float d6 = glm::dot(e2, cp);
+    if(d6 >= 0.0f && d5 <= d6) { return v0 + e2; }
+
+    float vb = d5 * d2 - d1 * d6;
+    if(vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) { return v0 + e2 * (d2 / (d2 - d6)); }
+
+    float va = d3 * d6 - d5 * d4;
+    if(va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+    {
+        float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+        return v0 + e1 + (e2 - e1) * w;
+    }
+
+    float denom = 1.0f / (va + vb + vc);
+    return v0 + e1 * (vb * denom) + e2 * (vc * denom);
+}
+
+// Squared distance from p to the box, 0 inside
+static float distanceSquared(const LinearNode& node, const glm::vec3& p)
+{
+    glm::vec3 d = glm::max(glm::max(node.min_corner - p, p - node.max_corner), glm::vec3(0.0f));
+    return glm::dot(d, d);
+}
+
+// Same traversal as intersect, with the distance to the box in place of the
+// ray entry distance. The leaves read the vertices from their SIMD blocks
+bool AABBTree::closestPoint(const glm::vec3& p, float max_distance, ClosestHit& hit) const
+{
+    if(nodes.empty()) { return false; }
+
+    float best = max_distance * max_distance;
+    float root_distance = distanceSquared(nodes[0], p);
+    if(root_distance > best) { return false; }
+
+    bool found = false;
+    unsigned stack[TRAVERSAL_STACK_SIZE];
+    float stack_d[TRAVERSAL_STACK_SIZE];
+    int top = 0;
+    stack[top] = 0;
+    stack_d[top] = root_distance;
+    ++top;
+
+    while(top > 0)
+    {
+        --top;
+        if(stack_d[top] > best) { continue; } // A closer point was found meanwhile
+        const LinearNode& node = nodes[stack[top]];
+
+        if(node.isLeaf())
+        {
+            for(unsigned i = 0; i < node.count; ++i)
+            {
+                const TriangleBlock& block = blocks[node.offset + i / SIMD_WIDTH];
+                unsigned lane = i % SIMD_WIDTH;
+                glm::vec3 v0(block.v0x[lane], block.v0y[lane], block.v0z[lane]);
+                glm::vec3 e1(block.e1x[lane], block.e1y[lane], block.e1z[lane]);
+                glm::vec3 e2(block.e2x[lane], block.e2y[lane], block.e2z[lane]);
+
+                glm::vec3 q = closestPointOnTriangle(p, v0, e1, e2);
+                float d = glm::dot(p - q, p - q);
+                if(d < best)
+                {
+                    glm::vec3 normal = glm::cross(e1, e2);
+                    float length = glm::length(normal);
+                    best = d;
+                    hit.point = q;
+                    hit.normal = length > 0.0f ? normal / length : glm::vec3(0.0f);
+                    hit.face = mesh.ids[block.triangle[lane]];
+                    found = true;
+                }
+            }
+            continue;
+        }
+
+        unsigned first = stack[top] + 1;
+        unsigned second = node.offset;
+        float d_first = distanceSquared(nodes[first], p);
+        float d_second = distanceSquared(nodes[second], p);
+
+        // Push the farther child first so the nearer one is popped next
+        if(d_second < d_first)
+        {
+            std::swap(first, second);
+            std::swap(d_first, d_second);
+        }
+        if(d_second <= best)
+        {
+            stack[top] = second;
+            stack_d[top] = d_second;
+            ++top;
+        }
+        if(d_first <= best)
+        {
+            stack[top] = first;
+            stack_d[top] = d_first;
+            ++top;
+        }
+    }
+
+    if(found) { hit.distance = std::sqrt(best); }
+    return found;
+}
+
+// Rebuilds the top level. A median build over N boxes is O(N log N), which is
+// cheap enough to redo every frame instead of refitting as the instances move
+void InstanceTree::build(const AABBTree& mesh_tree, const std::vector<glm::vec3>& positions)
+{
+    this->mesh_tree = &mesh_tree;
+    this->positions = positions;
+    nodes.clear();
+    order.resize(positions.size());
+    for(unsigned i = 0; i < order.size(); ++i) order[i] = i;
+    if(positions.empty() || mesh_tree.nodes.empty()) { return; }
+
+    // World bounds of each instance: the mesh bounds moved to its position
+    AABB mesh_bounds = mesh_tree.bounds();
+    std::vector<AABB> instance_bounds(positions.size());
+    std::vector<glm::vec3> centers(positions.size());
+    for(size_t i = 0; i < positions.size(); ++i)
+    {
+        instance_bounds[i] = AABB(mesh_bounds.min_corner + positions[i],
+                                  mesh_bounds.max_corner + positions[i]);
+        centers[i] = (instance_bounds[i].min_corner + instance_bounds[i].max_corner) * 0.5f;
+    }
+
+    nodes.reserve(2 * positions.size() - 1);
+    build(0, static_cast<unsigned>(order.size()), instance_bounds, centers);
+}
+
+unsigned InstanceTree::build(unsigned begin, unsigned end,
+                             const std::vector<AABB>& instance_bounds,
+                             const std::vector<glm::vec3>& centers)
+{
+    unsigned index = static_cast<unsigned>(nodes.size());
+    nodes.emplace_back();
+
+    AABB box = AABB::empty();
+    for(unsigned i = begin; i < end; ++i) { box.expand(instance_bounds[order[i]]); }
+    nodes[index].min_corner = box.min_corner;
+    nodes[index].max_corner = box.max_corner;
+
+    // One instance per leaf: its own mesh tree already does the fine work
+    if(end - begin == 1)
+    {
+        nodes[index].offset = begin;
+        nodes[index].count = 1;
+        return index;
+    }
+
+    unsigned short axis = box.getLargestAxis();
+    unsigned middle = begin + (end - begin) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+                     [&](unsigned a, unsigned b) { return centers[a][axis] < centers[b][axis]; });
+
+    build(begin, middle, instance_bounds, centers); // Lands at index + 1
+    unsigned second = build(middle, end, instance_bounds, centers);
+    nodes[index].offset = second;
+    return index;
+}
+
+// Same front-to-back traversal as AABBTree::intersect; at a leaf the ray moves
+// into the instance's space and continues down the shared mesh tree
+bool InstanceTree::intersect(const glm::vec3& origin, const glm::vec3& dir,
+                             RayHit& hit, float t_max) const
+{
+    if(nodes.empty()) { return false; }
+
+    glm::vec3 inv_dir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+
+    float t_near;
+    if(!nodes[0].bounds().intersectRay(origin, inv_dir, t_max, t_near)) { return false; }
+
+    bool found = false;
+    hit.t = t_max;
+
+    unsigned stack[TRAVERSAL_STACK_SIZE];
+    float stack_t[TRAVERSAL_STACK_SIZE];
+    int top = 0;
+    stack[top] = 0;
+    stack_t[top] = t_near;
+    ++top;
+
+    while(top > 0)
+    {
+        --top;
+        if(stack_t[top] > hit.t) { continue; }
+        const LinearNode& node = nodes[stack[top]];
+
+        if(node.isLeaf())
+        {
+            for(unsigned i = node.offset; i < node.offset + node.count; ++i)
+            {
+                unsigned instance = order[i];
+                // A translation does not change the ray's t, so hits compare directly
+                RayHit local;
+                if(mesh_tree->intersect(origin - positions[instance], dir, local, hit.t))
+                {
+                    hit = local;
+                    hit.instance = instance;
+                    found = true;
+                }
+            }
+            continue;
+        }
+
+        unsigned first = stack[top] + 1;
+        unsigned second = node.offset;
+
+        float t_first, t_second;
+        bool hit_first = nodes[first].bounds().intersectRay(origin, inv_dir, hit.t, t_first);
+        bool hit_second = nodes[second].bounds().intersectRay(origin, inv_dir, hit.t, t_second);
+
+        if(hit_first && hit_second && t_second < t_first)
+        {
+            std::swap(first, second);
+            std::swap(t_first, t_second);
+        }
+        if(hit_second)
+        {
+            stack[top] = second;
+            stack_t[top] = t_second;
+            ++top;
+        }
+        if(hit_first)
+        {
+            stack[top] = first;
+            stack_t[top] = t_first;
+            ++top;
+        }
+    }
+    return found;
 }
@@ -0,0 +1,92 @@
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "hpp/physics.hpp"
+#include "hpp/thread_pool.hpp"
+
+// Micro-benchmark das forças das molas do tecido: compara computeSpringForces
+// (AoS, espalhando a força nas duas pontas de cada aresta) com o kernel SoA em
+// ELL, numa thread e no pool, para tecidos de 1k, 64k e 1M partículas
+//
+// Uso: ./bench_cloth [threads] [repeticoes]
+
+// Tempo em segundos da melhor de repeticoes chamadas de f()
+template <typename F>
+double medir(F f, int repeticoes) {
+    double melhor = 1e30;
+    for (int r = 0; r < repeticoes; ++r) {
+        auto inicio = std::chrono::steady_clock::now();
+        f();
+        melhor = std::min(melhor, std::chrono::duration<double>(std::chrono::steady_clock::now() - inicio).count());
+    }
+    return melhor;
+}
+
+void relatorio(const std::string& nome, double segundos, double molas, double base) {
+    std::cout << "  " << nome << ": " << segundos * 1e3 << " ms, "
+              << molas / segundos * 1e-6 << " M molas/s";
+    if (base > 0.0) std::cout << " (" << base / segundos << "x)";
+    std::cout << "\n";
+}
+
+int main(int argc, char** argv) {
+    unsigned nThreads = (argc > 1) ? static_cast<unsigned>(std::stoi(argv[1])) : 0;
+    int repeticoes = (argc > 2) ? std::stoi(argv[2]) : 5;
+    setThreadCount(nThreads);
+    std::cout << globalThreadPool().size() << " threads\n";
+
+    bool iguais = true;
+    for (int lado : {32, 256, 1024}) {
+        // Grade de lado x lado partículas, com as posições e velocidades perturbadas
+        // para as molas não estarem em repouso
+        Cloth cloth;
+        int quadrados = lado - 1;
+        createCloth(cloth, 2 * quadrados * quadrados, 0.05f, 1.0f);
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<float> ruido(-0.01f, 0.01f);
+        for (auto& p : cloth.positions) p += glm::vec3(ruido(rng), ruido(rng), ruido(rng));
+        for (auto& v : cloth.velocities) v = glm::vec3(ruido(rng), ruido(rng), ruido(rng));
+
+        size_t n = cloth.positions.size();
+        double molas = double(cloth.edges.size());
+        std::cout << n << " particulas, " << cloth.edges.size() << " molas\n";
+
+        std::vector<glm::vec3> F(n);
+        double tAoS = medir([&] {
+            std::fill(F.begin(), F.end(), glm::vec3(0.0f));
+            computeSpringForces(cloth, F);
+        }, repeticoes);
+
+        ClothSoA soa;
+        buildClothSoA(cloth, soa);
+        loadClothSoA(cloth, soa);
+
+        unsigned threads = globalThreadPool().size();
+        setThreadCount(1);
+        double tSoA = medir([&] { computeSpringForces(soa); }, repeticoes);
+        setThreadCount(threads);
+        double tPool = medir([&] { computeSpringForces(soa); }, repeticoes);
+
+        // Cada mola é somada em ordem diferente nos dois caminhos, então a
+        // comparação é relativa à maior força
+        float maior = 0.0f, diferenca = 0.0f;
+        for (size_t i = 0; i < n; ++i) {
+            glm::vec3 f(soa.fx[i], soa.fy[i], soa.fz[i]);
+            maior = std::max(maior, glm::length(F[i]));
+            diferenca = std::max(diferenca, glm::length(f - F[i]));
+        }
+        iguais = iguais && diferenca <= 1e-4f * maior;
+
+        relatorio("AoS, espalhando", tAoS, molas, 0.0);
+        relatorio("SoA, 1 thread  ", tSoA, molas, tAoS);
+        relatorio("SoA, pool      ", tPool, molas, tAoS);
+        std::cout << "  Diferenca maxima: " << diferenca << " (forca maxima " << maior << ")\n";
+    }
+
+    return iguais ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+#include <glm/glm.hpp>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "hpp/raycast.hpp"
+
+// Micro-benchmark dos kernels de interseção: compara o rayTriangleIntersect
+// escalar com os kernels SIMD (um raio x bloco de triângulos e pacote de raios x triângulo)
+//
+// Uso: ./bench_raycast [N_triangulos] [N_raios]
+
+struct Triangle {
+    glm::vec3 v0, v1, v2;
+};
+
+// Tempo em segundos gasto por f()
+template <typename F>
+double medir(F f) {
+    auto inicio = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - inicio).count();
+}
+
+void relatorio(const std::string& nome, double segundos, double testes, double base) {
+    std::cout << "  " << nome << ": " << segundos * 1e3 << " ms, "
+              << testes / segundos * 1e-6 << " M testes/s";
+    if (base > 0.0) std::cout << " (" << base / segundos << "x)";
+    std::cout << "\n";
+}
+
+int main(int argc, char** argv) {
+    int nTriangulos = (argc > 1) ? std::stoi(argv[1]) : 4096;
+    int nRaios = (argc > 2) ? std::stoi(argv[2]) : 4096;
+    nRaios = (nRaios + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH; // pacotes completos
+
+    // Triângulos aleatórios dentro de um cubo e raios da esfera em volta para o centro
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> pos(-10.0f, 10.0f);
+    std::uniform_real_distribution<float> lado(-2.0f, 2.0f);
+
+    std::vector<Triangle> triangulos(nTriangulos);
+    for (auto& tri : triangulos) {
+        tri.v0 = glm::vec3(pos(rng), pos(rng), pos(rng));
+        tri.v1 = tri.v0 + glm::vec3(lado(rng), lado(rng), lado(rng));
+        tri.v2 = tri.v0 + glm::vec3(lado(rng), lado(rng), lado(rng));
+    }
+
+    std::vector<glm::vec3> origens(nRaios), direcoes(nRaios);
+    for (int i = 0; i < nRaios; ++i) {
+        glm::vec3 alvo(pos(rng), pos(rng), pos(rng));
+        origens[i] = glm::normalize(glm::vec3(pos(rng), pos(rng), pos(rng))) * 30.0f;
+        direcoes[i] = glm::normalize(alvo - origens[i]);
+    }
+
+    std::vector<TriangleBlock> blocos((nTriangulos + SIMD_WIDTH - 1) / SIMD_WIDTH);
+    for (int i = 0; i < nTriangulos; ++i) {
+        blocos[i / SIMD_WIDTH].push(triangulos[i].v0, triangulos[i].v1, triangulos[i].v2, i);
+    }
+
+    double testes = double(nTriangulos) * nRaios;
+    std::cout << "SIMD_WIDTH = " << SIMD_WIDTH << ", " << nTriangulos << " triangulos, "
+              << nRaios << " raios\n";
+
+    // Referência: cada raio contra cada triângulo, um por vez
+    std::vector<int> escalar(nRaios, -1);
+    double tEscalar = medir([&] {
+        for (int r = 0; r < nRaios; ++r) {
+            float maisPerto = 1e30f;
+            for (int i = 0; i < nTriangulos; ++i) {
+                float t, u, v;
+                if (rayTriangleIntersect(origens[r], direcoes[r],
+                                         triangulos[i].v0, triangulos[i].v1, triangulos[i].v2, t, u, v)
+                    && t < maisPerto) {
+                    maisPerto = t;
+                    escalar[r] = i;
+                }
+            }
+        }
+    });
+
+    // Um raio contra SIMD_WIDTH triângulos por chamada
+    std::vector<int> bloco(nRaios, -1);
+    double tBloco = medir([&] {
+        for (int r = 0; r < nRaios; ++r) {
+            float maisPerto = 1e30f;
+            for (const auto& b : blocos) {
+                float t, u, v;
+                int lane = rayTriangleBlockIntersect(origens[r], direcoes[r], b, maisPerto, t, u, v);
+                if (lane >= 0) {
+                    maisPerto = t;
+                    bloco[r] = b.triangle[lane];
+                }
+            }
+        }
+    });
+
+    // SIMD_WIDTH raios contra um triângulo por chamada
+    std::vector<int> pacote(nRaios, -1);
+    double tPacote = medir([&] {
+        for (int r = 0; r < nRaios; r += SIMD_WIDTH) {
+            RayPacket raios;
+            float t[SIMD_WIDTH], u[SIMD_WIDTH], v[SIMD_WIDTH];
+            for (int lane = 0; lane < SIMD_WIDTH; ++lane) {
+                raios.set(lane, origens[r + lane], direcoes[r + lane]);
+                t[lane] = 1e30f;
+            }
+            for (int i = 0; i < nTriangulos; ++i) {
+                unsigned mask = rayPacketTriangleIntersect(raios, triangulos[i].v0, triangulos[i].v1,
+                                                           triangulos[i].v2, t, u, v);
+                for (int lane = 0; lane < SIMD_WIDTH; ++lane) {
+                    if (mask >> lane & 1u) pacote[r + lane] = i;
+                }
+            }
+        }
+    });
+
+    // Os kernels devem achar os mesmos triângulos que o caminho escalar
+    int diferencasBloco = 0, diferencasPacote = 0, acertos = 0;
+    for (int r = 0; r < nRaios; ++r) {
+        acertos += escalar[r] >= 0;
+        diferencasBloco += bloco[r] != escalar[r];
+        diferencasPacote += pacote[r] != escalar[r];
+    }
+
+    std::cout << acertos << " raios atingem algum triangulo\n";
+    relatorio("escalar         ", tEscalar, testes, 0.0);
+    relatorio("raio x bloco    ", tBloco, testes, tEscalar);
+    relatorio("pacote x triang.", tPacote, testes, tEscalar);
+    std::cout << "Diferencas com o escalar: bloco " << diferencasBloco
+              << ", pacote " << diferencasPacote << "\n";
+
+    return (diferencasBloco == 0 && diferencasPacote == 0) ? 0 : 1;
+}
@@ -0,0 +1,229 @@
+#include "hpp/broadphase.hpp"
+#include "hpp/thread_pool.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// Variance of the box centers along each axis. The current axis is kept
+// unless another one is clearly better, since switching throws away the order
+unsigned SweepAndPrune::chooseAxis(const std::vector<AABB>& boxes, unsigned current)
+{
+    glm::dvec3 sum(0.0), sum_sq(0.0);
+    for(const AABB& box : boxes)
+    {
+        glm::dvec3 center = glm::dvec3(box.min_corner + box.max_corner) * 0.5;
+        sum += center;
+        sum_sq += center * center;
+    }
+    glm::dvec3 mean = sum / double(boxes.size());
+    glm::dvec3 variance = sum_sq / double(boxes.size()) - mean * mean;
+
+    unsigned best = current;
+    for(unsigned axis = 0; axis < 3; ++axis)
+    {
+        if(variance[axis] > 1.25 * variance[best]) { best = axis; }
+    }
+    return best;
+}
+
+// Insertion sort is linear on an almost sorted array. When the bodies moved so
+// much that it would go quadratic, it gives up and sorts from scratch
+void SweepAndPrune::sortEntries()
+{
+    const size_t max_moves = 8 * entries.size() + 64;
+    size_t moves = 0;
+    for(size_t k = 1; k < entries.size(); ++k)
+    {
+        Entry entry = entries[k];
+        size_t j = k;
+        while(j > 0 && entries[j - 1].min > entry.min)
+        {
+            entries[j] = entries[j - 1];
+            --j;
+            ++moves;
+        }
+        entries[j] = entry;
+
+        if(moves > max_moves)
+        {
+            std::sort(entries.begin(), entries.end(),
+                      [](const Entry& a, const Entry& b) { return a.min < b.min; });
+            return;
+        }
+    }
+}
+
+void SweepAndPrune::update(const std::vector<AABB>& boxes, std::vector<CollisionPair>& pairs)
+{
+    pairs.clear();
+    if(boxes.size() < 2) { entries.clear(); return; }
+
+    // A new body count or sweep axis invalidates the order kept from the last call
+    unsigned new_axis = chooseAxis(boxes, sweep_axis);
+    if(entries.size() != boxes.size() || new_axis != sweep_axis)
+    {
+        entries.resize(boxes.size());
+        for(unsigned i = 0; i < entries.size(); ++i) { entries[i].body = i; }
+        sweep_axis = new_axis;
+    }
+    for(Entry& entry : entries) { entry.min = boxes[entry.body].min_corner[sweep_axis]; }
+    sortEntries();
+
+    // Bounds copied in sweep order, so the inner loop reads memory sequentially
+    unsigned u = (sweep_axis + 1) % 3, v = (sweep_axis + 2) % 3;
+    sorted.resize(entries.size());
+    for(size_t k = 0; k < entries.size(); ++k)
+    {
+        const AABB& box = boxes[entries[k].body];
+        sorted[k] = {box.max_corner[sweep_axis],
+                     box.min_corner[u], box.max_corner[u],
+                     box.min_corner[v], box.max_corner[v]};
+    }
+
+    // Every body is compared with the bodies that start before it ends; the
+    // other two axes are tested without branches since most candidates fail them
+    for(size_t k = 0; k < sorted.size(); ++k)
+    {
+        const SweepBounds& box = sorted[k];
+        for(size_t j = k + 1; j < sorted.size() && entries[j].min <= box.max; ++j)
+        {
+            const SweepBounds& other = sorted[j];
+            bool overlap = (box.min_u <= other.max_u) & (other.min_u <= box.max_u)
+                         & (box.min_v <= other.max_v) & (other.min_v <= box.max_v);
+            if(!overlap) { continue; }
+            unsigned a = entries[k].body, b = entries[j].body;
+            pairs.emplace_back(std::min(a, b), std::max(a, b));
+        }
+    }
+    std::sort(pairs.begin(), pairs.end());
+}
+
+// Bodies per parallel work item. Fixed, so the work split never depends on the thread count
+static constexpr size_t GRID_GRAIN = 1024;
+
+static unsigned hashCell(int x, int y, int z)
+{
+    return (static_cast<unsigned>(x) * 73856093u)
+         ^ (static_cast<unsigned>(y) * 19349663u)
+         ^ (static_cast<unsigned>(z) * 83492791u);
+}
+
+glm::ivec3 SpatialHashGrid::cellOf(const glm::vec3& p) const
+{
+    return glm::ivec3(static_cast<int>(std::floor(p.x / cell_size)),
+                      static_cast<int>(std::floor(p.y / cell_size)),
+                      static_cast<int>(std::floor(p.z / cell_size)));
+}
+
+// Sorts fixed-size chunks in parallel, then merges neighbouring runs in
+// parallel rounds. Every entry is distinct, so the result is the same sorted
+// array whatever the split
+void SpatialHashGrid::sortEntries()
+{
+    size_t count = entries.size();
+    parallelFor(count, GRID_GRAIN, [&](size_t begin, size_t end) {
+        std::sort(entries.begin() + begin, entries.begin() + end);
+    });
+
+    scratch.resize(count);
+    for(size_t width = GRID_GRAIN; width < count; width *= 2)
+    {
+        size_t merges = (count + 2 * width - 1) / (2 * width);
+        parallelFor(merges, 1, [&](size_t first, size_t last) {
+            for(size_t m = first; m < last; ++m)
+            {
+                size_t begin = m * 2 * width;
+                size_t middle = std::min(begin + width, count);
+                size_t end = std::min(begin + 2 * width, count);
+                std::merge(entries.begin() + begin, entries.begin() + middle,
+                           entries.begin() + middle, entries.begin() + end,
+                           scratch.begin() + begin);
+            }
+        });
+        entries.swap(scratch);
+    }
+}
+
+void SpatialHashGrid::update(const std::vector<AABB>& boxes, std::vector<CollisionPair>& pairs)
+{
+    pairs.clear();
+    size_t n = boxes.size();
+    if(n < 2) { return; }
+
+    // Number of cells each body covers, then where its entries start
+    first_entry.assign(n + 1, 0);
+    parallelFor(n, GRID_GRAIN, [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; ++i)
+        {
+            glm::ivec3 lo = cellOf(boxes[i].min_corner);
+            glm::ivec3 hi = cellOf(boxes[i].max_corner);
+            first_entry[i + 1] = (hi.x - lo.x + 1) * (hi.y - lo.y + 1) * (hi.z - lo.z + 1);
+        }
+    });
+    for(size_t i = 0; i < n; ++i) { first_entry[i + 1] += first_entry[i]; }
+
+    // Insert every body into its cells
+    entries.resize(first_entry[n]);
+    parallelFor(n, GRID_GRAIN, [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; ++i)
+        {
+            glm::ivec3 lo = cellOf(boxes[i].min_corner);
+            glm::ivec3 hi = cellOf(boxes[i].max_corner);
+            unsigned e = first_entry[i];
+            for(int x = lo.x; x <= hi.x; ++x)
+                for(int y = lo.y; y <= hi.y; ++y)
+                    for(int z = lo.z; z <= hi.z; ++z)
+                        entries[e++] = {hashCell(x, y, z), x, y, z, static_cast<unsigned>(i)};
+        }
+    });
+
+    // Entries of the same cell end up next to each other
+    sortEntries();
+    cell_starts.clear();
+    for(size_t e = 0; e < entries.size(); ++e)
+    {
+        if(e == 0 || !entries[e].sameCell(entries[e - 1])) { cell_starts.push_back(static_cast<unsigned>(e)); }
+    }
+    cell_starts.push_back(static_cast<unsigned>(entries.size()));
+
+    // Compare the bodies of every cell. Two boxes can share several cells, so a
+    // pair is only reported by the cell holding the lower corner of their overlap
+    size_t cells = cell_starts.size() - 1;
+    size_t chunks = (cells + GRID_GRAIN - 1) / GRID_GRAIN;
+    std::vector<std::vector<CollisionPair>> chunk_pairs(chunks);
+    parallelFor(cells, GRID_GRAIN, [&](size_t begin, size_t end) {
+        std::vector<CollisionPair>& out = chunk_pairs[begin / GRID_GRAIN];
+        for(size_t c = begin; c < end; ++c)
+        {
+            for(unsigned a = cell_starts[c]; a < cell_starts[c + 1]; ++a)
+            {
+                const AABB& box_a = boxes[entries[a].body];
+                for(unsigned b = a + 1; b < cell_starts[c + 1]; ++b)
+                {
+                    const AABB& box_b = boxes[entries[b].body];
+                    if(!box_a.overlaps(box_b)) { continue; }
+
+                    glm::ivec3 owner = cellOf(glm::max(box_a.min_corner, box_b.min_corner));
+                    if(owner.x != entries[a].x || owner.y != entries[a].y || owner.z != entries[a].z) { continue; }
+
+                    out.emplace_back(entries[a].body, entries[b].body); // Sorted by body within a cell
+                }
+            }
+        }
+    });
+
+    for(const auto& chunk : chunk_pairs) { pairs.insert(pairs.end(), chunk.begin(), chunk.end()); }
+    std::sort(pairs.begin(), pairs.end());
+}
+
+void allPairs(const std::vector<AABB>& boxes, std::vector<CollisionPair>& pairs)
+{
+    pairs.clear();
+    for(unsigned i = 0; i < boxes.size(); ++i)
+    {
+        for(unsigned j = i + 1; j < boxes.size(); ++j)
+        {
+            if(boxes[i].overlaps(boxes[j])) { pairs.emplace_back(i, j); }
+        }
+    }
+}
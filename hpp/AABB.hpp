@@ -1,9 +1,15 @@
+#ifndef AABB_HPP
+#define AABB_HPP
+
 #include <iostream>
 #include <vector>
 #include <array>
 #include<glm/glm.hpp>
 #include <memory>
 #include <algorithm>
+#include <limits>
+#include <map>
+#include "raycast.hpp"
 
 // Axis-Aligned Bounding Box (AABB) structure
 struct AABB
@@ -19,7 +25,7 @@ struct AABB
         min_corner{min}
     {}
 
-    // Checks if is valid 
+    // Checks if is valid
     bool contains(const glm::vec3& p) const {
         return (p.x >= min_corner.x && p.x <= max_corner.x
               && p.y >= min_corner.y && p.y <= max_corner.y
@@ -45,6 +51,61 @@ struct AABB
         }
     }
 
+    // Checks if the two boxes touch or overlap
+    bool overlaps(const AABB& other) const {
+        return (min_corner.x <= other.max_corner.x && max_corner.x >= other.min_corner.x
+              && min_corner.y <= other.max_corner.y && max_corner.y >= other.min_corner.y
+              && min_corner.z <= other.max_corner.z && max_corner.z >= other.min_corner.z);
+    }
+
+    // Grows the box so it also encloses p
+    void expand(const glm::vec3& p)
+    {
+        min_corner = glm::min(min_corner, p);
+        max_corner = glm::max(max_corner, p);
+    }
+
+    // Grows the box so it also encloses other
+    void expand(const AABB& other)
+    {
+        min_corner = glm::min(min_corner, other.min_corner);
+        max_corner = glm::max(max_corner, other.max_corner);
+    }
+
+    // Area of the box surface, 0 for an empty box
+    float surfaceArea() const
+    {
+        glm::vec3 size = glm::max(max_corner - min_corner, glm::vec3(0.0f));
+        return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+
+    // Box that contains nothing, the starting point for expand()
+    static AABB empty()
+    {
+        return AABB(glm::vec3(std::numeric_limits<float>::max()),
+                    glm::vec3(-std::numeric_limits<float>::max()));
+    }
+
+    // Slab test: returns true if the ray enters the box before t_max.
+    // inv_dir is 1/dir per component, t_near receives the entry distance
+    bool intersectRay(const glm::vec3& origin, const glm::vec3& inv_dir,
+                      float t_max, float& t_near) const
+    {
+        float t0 = 0.0f;
+        float t1 = t_max;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float t_a = (min_corner[axis] - origin[axis]) * inv_dir[axis];
+            float t_b = (max_corner[axis] - origin[axis]) * inv_dir[axis];
+            if (t_a > t_b) std::swap(t_a, t_b);
+            t0 = t_a > t0 ? t_a : t0;
+            t1 = t_b < t1 ? t_b : t1;
+            if (t0 > t1) return false;
+        }
+        t_near = t0;
+        return true;
+    }
+
     // Allows printing the AABB to the output
     friend std::ostream& operator<<(std::ostream& os, const AABB& aabb) {
         os << "AABB Corners:\n"
@@ -61,115 +122,214 @@ struct AABB
     std::pair<AABB, AABB> split(unsigned axis) const;
 };
 
-// Splits the AABB into two halves along the given axis
-std::pair<AABB, AABB> AABB::split(unsigned axis) const
-{
-    float mid_point = (min_corner[axis] + max_corner[axis]) * 0.5f;
-    std::cout << mid_point << "mid \n";
-
-    glm::vec3 first_max{max_corner};
-    first_max[axis] = mid_point;
-
-    glm::vec3 second_min{min_corner};
-    second_min[axis] = mid_point;
-
-    return {
-        AABB(min_corner, first_max),
-        AABB(second_min, max_corner)
-    };
-}
-
 // Structure representing a 3D mesh
 struct Mesh
 {
     using coordinate_t = std::vector<glm::vec3>; // List of vertex positions
     using triangles_t = std::vector<std::array<unsigned, 3>>; // List of triangle indices
+    using ids_t = std::vector<unsigned>; // Original index of each triangle
 
     AABB aabb; // Bounding box for the mesh
     coordinate_t coordinates; // Vertex positions
     triangles_t triangles; // Triangles made of 3 vertex indices
+    ids_t ids; // ids[i] is the caller's index for triangles[i]
 
-    // Constructor that takes coordinates and triangle data
+    // Constructor that takes coordinates and triangle data.
+    // Triangles are numbered 0..n-1 when no ids are given
     Mesh(const coordinate_t& coordinates,
-         const triangles_t& triangles):
+         const triangles_t& triangles,
+         const ids_t& ids = {}):
         coordinates{coordinates},
-        triangles{triangles}
+        triangles{triangles},
+        ids{ids}
     {
+        if (this->ids.empty())
+        {
+            this->ids.resize(this->triangles.size());
+            for (unsigned i = 0; i < this->ids.size(); ++i) this->ids[i] = i;
+        }
         updateAABB(); // Automatically compute the AABB
     }
 
     void updateAABB(); // Updates the mesh's bounding box
-
-    // Sorts triangles based on their centroid's position along a given axis
-    void sortTrianglesByAxis(unsigned axis)
-    {
-        auto comparator = [&](const std::array<unsigned, 3>& a, const std::array<unsigned, 3>& b)
-        {
-            glm::vec3 centroid_a = (coordinates[a[0]] + coordinates[a[1]] + coordinates[a[2]]) / 3.0f;
-            glm::vec3 centroid_b = (coordinates[b[0]] + coordinates[b[1]] + coordinates[b[2]]) / 3.0f;
-            return centroid_a[axis] < centroid_b[axis];
-        };
-
-        std::sort(triangles.begin(), triangles.end(), comparator);
-    }
-
-    // Splits the mesh's triangle list into two halves
-    std::pair<Mesh, Mesh> splitMesh();
 };
 
-// Splits the mesh into two submeshes based on the triangle list
-std::pair<Mesh, Mesh> Mesh::splitMesh()
+// Node in the AABB tree. It does not own geometry: it covers the range
+// [begin, end) of AABBTree::indices, which point into the tree's single Mesh
+struct AABBNode
 {
-    const size_t split_index = triangles.size() / 2;
+    AABB aabb;          // Bounds tight to the node's own triangles
+    unsigned begin{0};  // First entry of AABBTree::indices in this node
+    unsigned end{0};    // One past the last entry
+    bool leaf{false}; // True if this node is a leaf (no children)
 
-    triangles_t first_t, second_t;
+    std::unique_ptr<AABBNode> left_child{nullptr};
+    std::unique_ptr<AABBNode> right_child{nullptr};
 
-    // Divide triangles into two halves
-    first_t.assign(triangles.begin(), triangles.begin() + split_index);
-    second_t.assign(triangles.begin() + split_index, triangles.end());
+    AABBNode(unsigned begin, unsigned end):begin{begin}, end{end}{};
 
-    return {{coordinates, first_t}, {coordinates, second_t}};
-}
+    unsigned size() const {return end - begin;}
+    bool isLeaf() const {return leaf;}
+    void makeLeaf() { leaf = true;}
+};
 
-// Computes the AABB that encloses all the mesh's vertices
-void Mesh::updateAABB()
+// Node of the flattened tree. Nodes are stored depth-first in one array, so
+// the first child of an interior node is always the next node in memory.
+// 32 bytes: two nodes per cache line and no pointers to chase
+struct alignas(32) LinearNode
 {
-    glm::vec3 min{coordinates[0]};
-    glm::vec3 max{coordinates[0]};
+    glm::vec3 min_corner; // Bounds of the subtree
+    unsigned offset{0};   // Leaf: first block in AABBTree::blocks. Interior: index of the second child
+    glm::vec3 max_corner;
+    unsigned count{0};    // Number of triangles in a leaf, 0 for interior nodes
 
-    for(const auto& coord: coordinates)
-    {
-        min = glm::min(min, coord);
-        max = glm::max(max, coord);
-    }
+    bool isLeaf() const {return count > 0;}
+    AABB bounds() const {return AABB(min_corner, max_corner);}
+};
+static_assert(sizeof(LinearNode) == 32, "LinearNode must stay 32 bytes");
 
-    aabb = {min, max};
-}
+// How AABBTree::build chooses where to split a node
+enum class BuildStrategy
+{
+    Median, // Longest axis at the triangle-count median, one triangle per leaf
+    SAH     // Binned surface area heuristic, leaves of up to max_leaf_size triangles
+};
 
-// Node in the AABB tree
-struct AABBNode
+// Summary of how good a built tree is for ray traversal
+struct TreeQuality
 {
-    Mesh mesh;
-    bool leaf{false}; // True if this node is a leaf (only one triangle)
+    float sah_cost{0.0f};    // Expected traversal + intersection cost of a random ray hitting the root
+    unsigned depth{0};       // Longest root-to-leaf path (the root alone has depth 1)
+    unsigned node_count{0};
+    unsigned leaf_count{0};
+    std::map<unsigned, unsigned> leaf_sizes; // Triangles per leaf -> number of leaves
+
+    // Allows printing the report to the output
+    friend std::ostream& operator<<(std::ostream& os, const TreeQuality& quality) {
+        os << "AABB tree quality:\n"
+           << "  SAH cost: " << quality.sah_cost << "\n"
+           << "  Depth: " << quality.depth << "\n"
+           << "  Nodes: " << quality.node_count << " (" << quality.leaf_count << " leaves)\n"
+           << "  Leaf sizes:";
+        for (const auto& [size, count] : quality.leaf_sizes)
+        {
+            os << "\n    " << size << " triangles: " << count;
+        }
+        return os;
+    }
+};
 
-    std::unique_ptr<AABBNode> left_child{nullptr};
-    std::unique_ptr<AABBNode> right_child{nullptr};
+// Closest intersection found by a ray query
+struct RayHit
+{
+    float t{0.0f};    // Distance along the ray
+    float u{0.0f};    // Barycentric coordinate of v1
+    float v{0.0f};    // Barycentric coordinate of v2
+    unsigned face{0}; // Id of the triangle that was hit (Mesh::ids)
+    unsigned instance{0}; // Instance that was hit (InstanceTree queries only)
+};
 
-    AABBNode(const Mesh& mesh):mesh{mesh}{};
+// Closest point to p on the triangle (v0, v0 + e1, v0 + e2)
+glm::vec3 closestPointOnTriangle(const glm::vec3& p, const glm::vec3& v0,
+                                 const glm::vec3& e1, const glm::vec3& e2);
 
-    bool isLeaf() const {return leaf;}
-    void makeLeaf() { leaf = true;}
+// Point of the mesh closest to a query point
+struct ClosestHit
+{
+    glm::vec3 point{0.0f};  // Closest point on the surface
+    glm::vec3 normal{0.0f}; // Unit normal of the triangle, from its winding
+    float distance{0.0f};   // Distance from the query point to point
+    unsigned face{0};       // Id of the triangle (Mesh::ids)
 };
 
 // AABB Tree structure
 struct AABBTree
 {
-    std::unique_ptr<AABBNode> root{nullptr}; // Root node of the tree
+    Mesh mesh; // Shared vertex buffer and triangle list, never copied per node
+    std::vector<unsigned> indices; // Triangle permutation, nodes own ranges of it
+    std::unique_ptr<AABBNode> root{nullptr}; // Root node while building, released by build()
+    std::vector<LinearNode> nodes; // Flattened depth-first tree used by every query
+    std::vector<TriangleBlock> blocks; // Leaf triangles repacked SoA, ceil(count / SIMD_WIDTH) blocks per leaf
+    std::vector<float> built_quality; // Per node: SAH cost of the subtree over its own area, when it was built
+
+    BuildStrategy strategy{BuildStrategy::Median}; // Split rule used by build()
+    unsigned max_leaf_size{4}; // SAH: largest leaf the builder may create
+
+    // Constructor builds root node
+    AABBTree(const Mesh& mesh,
+             BuildStrategy strategy = BuildStrategy::Median,
+             unsigned max_leaf_size = 4);
+    void build();               // Builds the tree and flattens it into nodes
+    void print() const;         // Prints tree content
+    TreeQuality quality() const; // SAH cost, depth and leaf sizes of the built tree
+
+    // Bounds of the whole mesh (valid after build)
+    AABB bounds() const {return nodes.empty() ? AABB() : nodes[0].bounds();}
+
+    // Finds the closest triangle hit by the ray (origin + t * dir) with t < t_max.
+    // The ray must be in the same space as the mesh coordinates
+    bool intersect(const glm::vec3& origin, const glm::vec3& dir,
+                   RayHit& hit, float t_max = 1e30f) const;
+
+    // Collects the ids (Mesh::ids) of the triangles whose bounds overlap box
+    void query(const AABB& box, std::vector<unsigned>& out) const;
+
+    // Finds the point of the mesh closest to p, if it is closer than max_distance.
+    // Nearer children are visited first and boxes farther than the best point so far are skipped
+    bool closestPoint(const glm::vec3& p, float max_distance, ClosestHit& hit) const;
+
+    // Moves the mesh to new vertex positions (same vertices, same triangles) and
+    // recomputes every node's bounds bottom-up without changing the tree, O(nodes)
+    void refit(const Mesh::coordinate_t& coordinates);
+
+    // Refits, then rebuilds the topmost subtrees whose quality (SAH cost over the
+    // subtree's own area) grew past max_degradation times its value at build time.
+    // Returns the number of subtrees rebuilt
+    unsigned update(const Mesh::coordinate_t& coordinates, float max_degradation = 1.5f);
+
+private:
+    // Recursive builder, works on per-triangle bounds and centroids computed once
+    void build(std::unique_ptr<AABBNode>& node,
+               const std::vector<AABB>& triangle_bounds,
+               const std::vector<glm::vec3>& centroids,
+               unsigned depth);
+    // Picks the SAH split of the node. Returns false if a leaf is cheaper
+    bool splitSAH(AABBNode& node,
+                  const std::vector<AABB>& triangle_bounds,
+                  const std::vector<glm::vec3>& centroids,
+                  unsigned& middle);
+    unsigned flatten(const AABBNode* node); // Appends the subtree to nodes, returns its index
+    void subtreeQuality(std::vector<float>& result); // Current quality of every node, same measure as built_quality
+    unsigned subtreeEnd(unsigned index) const; // One past the last node of the subtree at index
+
+    // Scratch of update(), kept so that an update that only refits allocates nothing
+    std::vector<float> subtree_cost, current_quality;
+    std::vector<unsigned> node_depth;
+};
+
+// Two-level tree for many copies of one mesh. The top level is a BVH over the
+// world bounds of the instances; its leaves point into the shared mesh tree.
+// Instances are only translated, so a ray enters instance space by a subtraction
+struct InstanceTree
+{
+    const AABBTree* mesh_tree{nullptr}; // Bottom level shared by every instance
+    std::vector<glm::vec3> positions;   // Translation of each instance
+    std::vector<unsigned> order;        // Instance permutation, leaves own ranges of it
+    std::vector<LinearNode> nodes;      // Leaf: first entry in order. Interior: index of the second child
 
-    AABBTree(const Mesh& mesh); // Constructor builds root node
-    void build();               // Starts recursive construction
-    void print(std::unique_ptr<AABBNode>& node) const; // Prints tree content
+    // Rebuilds the top level over the current instance positions (once per frame)
+    void build(const AABBTree& mesh_tree, const std::vector<glm::vec3>& positions);
+
+    // Finds the closest triangle of any instance hit by the ray (world space).
+    // hit.instance receives the instance, hit.face the triangle id of the shared mesh
+    bool intersect(const glm::vec3& origin, const glm::vec3& dir,
+                   RayHit& hit, float t_max = 1e30f) const;
 
 private:
-    void build(std::unique_ptr<AABBNode>& node); // Recursive builder
+    // Median split over [begin, end) of order, written depth-first into nodes
+    unsigned build(unsigned begin, unsigned end,
+                   const std::vector<AABB>& instance_bounds,
+                   const std::vector<glm::vec3>& centers);
 };
+
+#endif
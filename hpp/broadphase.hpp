@@ -0,0 +1,106 @@
+#ifndef BROADPHASE_HPP
+#define BROADPHASE_HPP
+
+#include <utility>
+#include <vector>
+#include "AABB.hpp"
+
+// Pair of body indices whose boxes overlap, always with first < second
+using CollisionPair = std::pair<unsigned, unsigned>;
+
+// Incremental sweep-and-prune broad phase. Bodies are kept sorted by the
+// lower bound of their box along one axis between calls; since bodies move
+// little from one frame to the next, an insertion sort restores the order in
+// close to linear time. The sweep then only compares bodies whose intervals
+// overlap on that axis
+class SweepAndPrune
+{
+public:
+    // Takes the current world box of every body (index = body) and writes the
+    // overlapping pairs to pairs, sorted so the output does not depend on the
+    // order the bodies ended up in
+    void update(const std::vector<AABB>& boxes, std::vector<CollisionPair>& pairs);
+
+    unsigned axis() const {return sweep_axis;} // Axis used by the last update
+
+private:
+    struct Entry
+    {
+        float min; // Lower bound of the box on the sweep axis
+        unsigned body;
+    };
+
+    // Box bounds the sweep still needs once entries gives the lower bound on the
+    // sweep axis; u and v are the two other axes
+    struct SweepBounds
+    {
+        float max;
+        float min_u, max_u;
+        float min_v, max_v;
+    };
+
+    // Axis along which the box centers are most spread out, so the fewest
+    // intervals overlap on it
+    static unsigned chooseAxis(const std::vector<AABB>& boxes, unsigned current);
+    // Re-sorts entries by min, switching to a full sort when the order is too far off
+    void sortEntries();
+
+    std::vector<Entry> entries; // Bodies sorted by min, kept between updates
+    std::vector<SweepBounds> sorted; // Bounds in the order of entries, rebuilt by every update
+    unsigned sweep_axis{0};
+};
+
+// Uniform grid broad phase for dense clusters, where many intervals overlap
+// on every axis and sweep-and-prune degrades. Every body is inserted into the
+// cells its box covers; only bodies sharing a cell are compared. Cells are
+// hashed, so the grid is unbounded and its memory follows the body count.
+// Insertion, sorting and pair generation run on the global thread pool
+class SpatialHashGrid
+{
+public:
+    // cell_size should be about the largest box extent, so each body covers
+    // at most 2 cells per axis
+    explicit SpatialHashGrid(float cell_size = 1.0f): cell_size{cell_size} {}
+
+    void setCellSize(float size) {cell_size = size;}
+    float cellSize() const {return cell_size;}
+
+    // Same contract as SweepAndPrune::update. The pairs are identical for any
+    // number of threads
+    void update(const std::vector<AABB>& boxes, std::vector<CollisionPair>& pairs);
+
+private:
+    // One (cell, body) record, ordered by cell hash, then cell, then body
+    struct CellEntry
+    {
+        unsigned hash;
+        int x, y, z;
+        unsigned body;
+
+        bool sameCell(const CellEntry& other) const
+        {
+            return x == other.x && y == other.y && z == other.z;
+        }
+        bool operator<(const CellEntry& other) const
+        {
+            if(hash != other.hash) { return hash < other.hash; }
+            if(x != other.x) { return x < other.x; }
+            if(y != other.y) { return y < other.y; }
+            if(z != other.z) { return z < other.z; }
+            return body < other.body;
+        }
+    };
+
+    glm::ivec3 cellOf(const glm::vec3& p) const;
+    void sortEntries(); // Parallel merge sort of entries
+
+    float cell_size;
+    std::vector<unsigned> first_entry; // Body i owns entries [first_entry[i], first_entry[i + 1])
+    std::vector<CellEntry> entries, scratch;
+    std::vector<unsigned> cell_starts; // First entry of every occupied cell, plus the end
+};
+
+// Reference broad phase: tests every pair, O(N^2)
+void allPairs(const std::vector<AABB>& boxes, std::vector<CollisionPair>& pairs);
+
+#endif
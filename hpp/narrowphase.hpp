@@ -0,0 +1,76 @@
+#ifndef NARROWPHASE_HPP
+#define NARROWPHASE_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "AABB.hpp"
+#include "broadphase.hpp"
+
+// Rigid placement of a body: world = rotation * local + position
+struct BodyTransform
+{
+    glm::mat3 rotation{1.0f};
+    glm::vec3 position{0.0f};
+
+    glm::vec3 apply(const glm::vec3& p) const {return rotation * p + position;}
+};
+
+// Body as seen by the narrow phase: a built mesh tree (in local space, may be
+// shared by many bodies) and where the body is
+struct CollisionBody
+{
+    const AABBTree* tree{nullptr};
+    BodyTransform transform;
+};
+
+// Point where two triangles touch
+struct Contact
+{
+    unsigned body_a{0}, body_b{0}; // body_a < body_b for narrowPhase results
+    unsigned face_a{0}, face_b{0}; // Triangle ids (Mesh::ids) on each body
+    glm::vec3 point{0.0f};         // Midpoint between the deepest points of the two triangles
+    glm::vec3 normal{0.0f};        // Unit separating direction, pointing from a to b
+    float depth{0.0f};             // Distance to move b along normal to separate the triangles
+};
+
+// Limits that keep a mesh-vs-mesh query bounded however deep the bodies overlap
+struct NarrowPhaseOptions
+{
+    unsigned max_node_pairs{4096}; // Node pairs one body pair may visit
+    unsigned max_contacts{8};      // The query stops once this many contacts are found
+};
+
+// Work done by a dual-tree query
+struct NarrowPhaseStats
+{
+    unsigned node_pairs{0};         // Node pairs whose boxes were tested
+    unsigned triangle_pairs{0};     // Triangle pairs that reached the SAT test
+    bool budget_exhausted{false};   // Stopped at max_node_pairs before the end
+};
+
+// Separating axis test between two triangles (the 2 face normals and the 9
+// edge cross products, plus the in-plane edge normals when the triangles are
+// coplanar). Returns false if they are apart; otherwise fills point, normal and
+// depth of the axis with the least overlap. face and body ids are left alone
+bool triangleTriangleContact(const glm::vec3 a[3], const glm::vec3 b[3], Contact& contact);
+
+// Dual-tree traversal of two mesh trees at their transforms. A node pair is
+// only opened if the box of b, moved into a's space, overlaps the box of a;
+// the node with the larger box is split first. Contacts are appended to
+// contacts in world space, with face ids from the meshes and body ids 0 and 1.
+// Returns true if any triangles touch
+bool collideTrees(const AABBTree& a, const BodyTransform& transform_a,
+                  const AABBTree& b, const BodyTransform& transform_b,
+                  std::vector<Contact>& contacts,
+                  const NarrowPhaseOptions& options = {},
+                  NarrowPhaseStats* stats = nullptr);
+
+// Runs collideTrees over every broad phase pair on the global thread pool.
+// contacts receives the contacts grouped by pair, in the order of pairs, with
+// the body ids filled in; the result is the same for any number of threads
+void narrowPhase(const std::vector<CollisionBody>& bodies,
+                 const std::vector<CollisionPair>& pairs,
+                 std::vector<Contact>& contacts,
+                 const NarrowPhaseOptions& options = {});
+
+#endif
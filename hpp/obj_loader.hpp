@@ -8,6 +8,18 @@
 #include "hpp/physics.hpp" 
 #include "hpp/materials.hpp"
 
-bool loadOBJ(const std::string& objPath, PhysicalObject* object);
+// Carrega o OBJ (e os MTL que ele cita). Com useCache, a malha lida é gravada
+// em binário em meshCachePath(objPath) e as próximas cargas leem o cache
+// mapeado em memória, sem parsing nem cálculo de normais, enquanto o OBJ e os
+// MTL tiverem o mesmo tamanho e data de modificação
+bool loadOBJ(const std::string& objPath, PhysicalObject* object, bool useCache = true);
+
+// Cache binário versionado da malha: cabeçalho e vetores planos de vértices,
+// normais, triângulos e material de cada triângulo, mais o tamanho e a data
+// das fontes
+std::string meshCachePath(const std::string& objPath);
+bool writeMeshCache(const std::string& cachePath, const MeshData& mesh,
+                    const std::vector<std::string>& sources); // sources[0] é o OBJ
+bool loadMeshCache(const std::string& cachePath, const std::string& objPath, MeshData& mesh);
 
 #endif
@@ -3,7 +3,12 @@
 
 #include <glm/glm.hpp>  // Necessário para glm::dvec3
 #include "hpp/materials.hpp"
+#include <array>
+#include <cstdint>
 #include <map>
+#include <memory>
+#include <string>
+#include <vector>
 
 //fwefwefgwerg
 using Vec3 = glm::dvec3; 
@@ -14,42 +19,230 @@ extern const double AIR_DENSITY;
 double norm(const Vec3& v);
 Vec3 hat(const Vec3& a);
 
-struct Face {
-    std::vector<unsigned int> vertex_indices;
-    std::vector<unsigned int> normal_indices;
-    std::string material_name;
-};
-
 struct Cloth {
   std::vector<glm::vec3> positions;       // N partículas
   std::vector<glm::vec3> velocities;      // N velocidades
   std::vector<std::pair<int,int>> edges;  
   std::vector<float> restLengths;        
+  std::vector<std::array<unsigned,3>> triangles; // Dois por quadrado da grade, para a árvore AABB
   float mass = 0.9f;
 };
 
+// Geometria de um OBJ. Imutável depois de carregada e compartilhada por todas
+// as instâncias, que só guardam o próprio estado físico. Os polígonos são
+// triangulados em leque na carga e cada triângulo ocupa uma posição dos vetores
+// planos abaixo, então quem desenha, faz raycast ou monta a árvore AABB
+// percorre os triângulos em sequência, sem um registro alocado por face
+struct MeshData {
+    using triangle_t = std::array<unsigned, 3>;
+
+    std::vector<glm::vec3> vertices;
+    std::vector<glm::vec3> normals;
+    std::vector<triangle_t> triangles;     // Vértices de cada triângulo
+    std::vector<triangle_t> normalIndices; // Normais dos vértices de cada triângulo
+    std::vector<uint16_t> materialIds;     // Material de cada triângulo, índice em materialNames
+    std::vector<std::string> materialNames; // Nomes do usemtl; o id 0 é "" (sem material)
+    std::map<std::string, Material> materials;
+
+    // Material do triângulo t no mapa do MTL, ou nullptr se não houver
+    const Material* material(size_t t) const {
+        auto it = materials.find(materialNames[materialIds[t]]);
+        return it != materials.end() ? &it->second : nullptr;
+    }
+};
+
 struct PhysicalObject {
     double mass;
     double dragCoefficient;
     double frontalArea;
 
-    glm::dvec3 position;
+    glm::dvec3 position; // Transformação da instância (só translação)
     glm::dvec3 velocity;
 
-    std::vector<glm::vec3> vertices;
-    std::vector<glm::vec3> normals;
-    std::vector<Face> faces;
-    std::map<std::string, Material> materials;
+    std::shared_ptr<const MeshData> mesh; // Copiar o objeto não copia a malha
 };
 
+// Estado de muitos corpos rígidos em structure-of-arrays: cada campo fica num
+// vetor contíguo, então os kernels só leem o que usam e vetorizam por corpo
+struct RigidBodySoA {
+    std::vector<double> px, py, pz; // Posição
+    std::vector<double> vx, vy, vz; // Velocidade
+    std::vector<double> mass;
+    std::vector<double> drag;       // Coeficiente de arrasto
+    std::vector<double> area;       // Área frontal
+
+    size_t size() const { return px.size(); }
+    void resize(size_t n);
+    size_t add(const PhysicalObject& obj); // Copia o estado físico, retorna o índice
+
+    glm::dvec3 position(size_t i) const { return {px[i], py[i], pz[i]}; }
+    glm::dvec3 velocity(size_t i) const { return {vx[i], vy[i], vz[i]}; }
+    void setPosition(size_t i, const glm::dvec3& p) { px[i] = p.x; py[i] = p.y; pz[i] = p.z; }
+    void setVelocity(size_t i, const glm::dvec3& v) { vx[i] = v.x; vy[i] = v.y; vz[i] = v.z; }
+};
+
+// Faixa contígua de corpos de um RigidBodySoA, vista pelos kernels
+struct RigidBodySpan {
+    double *px, *py, *pz;
+    double *vx, *vy, *vz;
+    const double *mass, *drag, *area;
+    size_t count;
+};
+
+RigidBodySpan bodySpan(RigidBodySoA& bodies, size_t begin, size_t end);
+
 void update_ambient_forces(PhysicalObject* obj, double dt);
 void applyTornadoForce(PhysicalObject* obj, glm::vec3 center, double dt);
+
+// Mesmas forças de update_ambient_forces e applyTornadoForce para uma faixa
+// de corpos, sem desvios por corpo para o compilador vetorizar os laços
+void integrateAmbient(const RigidBodySpan& bodies, double dt);
+void applyTornado(const RigidBodySpan& bodies, glm::vec3 center, double dt);
+
+// Dividem os corpos em faixas e rodam os kernels no pool de threads
+void integrateAmbient(RigidBodySoA& bodies, double dt);
+void applyTornado(RigidBodySoA& bodies, glm::vec3 center, double dt);
 void createCloth(Cloth &cloth, int nFaces,
                  float spacing,
                  float initialHeight);
 
 void computeSpringForces(const Cloth& C, std::vector<glm::vec3>& F);
 void applyExternalForces(const Cloth& C, std::vector<glm::vec3>& F);
-void integrateCloth(Cloth& C, float dt);
+
+// Passo implícito do tecido (Euler para trás, Baraff e Witkin). O sistema
+// (M - dt df/dv - dt² df/dx) dv = dt (f + dt df/dx v) fica em block-CSR: cada
+// linha é uma partícula e cada bloco 3x3 fora da diagonal vem de uma mola.
+// A estrutura depende só das arestas e é montada uma vez; os valores são
+// remontados a cada passo. Mantido entre passos para não alocar nada depois do
+// primeiro e para o gradiente conjugado partir do dv anterior
+struct ClothImplicitSolver {
+    int maxIterations = 100;
+    float tolerance = 1e-4f; // Resíduo relativo (na norma do pré-condicionador) em que o CG para
+
+    std::vector<unsigned> rowStart;  // Blocos da linha i em [rowStart[i], rowStart[i + 1])
+    std::vector<unsigned> column;    // Coluna de cada bloco fora da diagonal
+    std::vector<unsigned> blockEdge; // Mola de cada bloco fora da diagonal
+    std::vector<glm::mat3> blocks;   // Valores fora da diagonal
+    std::vector<glm::mat3> diagonal, preconditioner; // Bloco da diagonal de cada linha e a sua inversa (Jacobi por blocos)
+
+    std::vector<glm::vec3> springForce;        // Força de cada mola na primeira partícula da aresta
+    std::vector<glm::mat3> stiffness, damping; // df/dx e df/dv de cada mola
+    std::vector<glm::vec3> rhs, dv, r, z, p, Ap;
+    std::vector<double> partial; // Somas parciais dos produtos escalares, uma por faixa
+
+    int iterations = 0;  // Iterações do último passo
+    float residual = 0;  // Resíduo relativo no fim do último passo
+};
+
+void integrateClothImplicit(Cloth& C, float dt, ClothImplicitSolver& solver);
+
+// Solver XPBD do tecido: cada aresta é uma restrição de distância com
+// complacência (inverso da rigidez), então a rigidez não depende do passo nem
+// do número de iterações. As arestas são coloridas de modo que as de mesma cor
+// não têm partícula em comum, e cada cor é projetada em paralelo sem disputa
+struct ClothXPBDSolver {
+    int iterations = 20;
+    float compliance = 1e-4f; // Complacência das arestas (m/N); 0 é inextensível
+
+    std::vector<unsigned> colorStart; // Arestas da cor c em [colorStart[c], colorStart[c + 1]) de order
+    std::vector<unsigned> order;      // Arestas agrupadas por cor
+    std::vector<float> lambda;        // Multiplicador de cada aresta no passo
+    std::vector<glm::vec3> previous;  // Posições no começo do passo
+
+    size_t colors() const { return colorStart.empty() ? 0 : colorStart.size() - 1; }
+};
+
+void integrateClothXPBD(Cloth& C, float dt, ClothXPBDSolver& solver);
+
+// Estado da autocolisão do tecido, mantido entre subpassos para não alocar nada
+// depois do primeiro. Cada triângulo entra em todas as células que a sua caixa
+// (aumentada de thickness) toca; as entradas ficam agrupadas por posição na
+// tabela hash em order, com a posição h em [start[h], start[h + 1]).
+// A grade é refeita a cada subpasso com counting sort
+struct ClothSelfCollision {
+    float thickness = 0.02f; // Distância mínima entre partes do tecido que não são vizinhas
+
+    std::vector<glm::vec3> boxMin, boxMax;   // Caixa aumentada de cada triângulo
+    std::vector<unsigned> firstEntry;        // Entradas do triângulo t em [firstEntry[t], firstEntry[t + 1])
+    std::vector<glm::ivec3> entryCell;       // Célula de cada entrada
+    std::vector<unsigned> entryHash;         // Posição na tabela de cada entrada
+    std::vector<unsigned> start;             // Tamanho da tabela + 1
+    std::vector<unsigned> order;             // Triângulo de cada entrada, ordenado por posição
+    std::vector<glm::ivec3> sorted;          // Célula de cada entrada de order, lida em sequência na busca
+    std::vector<glm::vec3> displacement, velocityChange; // Correção de cada partícula
+};
+
+// Afasta cada partícula a pelo menos thickness dos triângulos que não a contêm.
+// Cada partícula junta as correções dos seus contatos (Jacobi), então as
+// partículas rodam em paralelo sem escrever nas outras. Retorna o número de
+// partículas corrigidas
+unsigned resolveSelfCollisions(Cloth& C, ClothSelfCollision& state);
+
+// Tecido em structure-of-arrays para o kernel das molas. As molas de cada
+// partícula ficam em ELL: width colunas, a coluna k com o k-ésimo vizinho de
+// todas as partículas em neighbor[k * n, (k + 1) * n). O laço por partícula lê
+// os vizinhos e só escreve a força da própria partícula, então vetoriza e roda
+// em paralelo sem atomics; cada mola é calculada uma vez em cada ponta
+struct ClothSoA {
+    std::vector<float> x, y, z;    // Posição
+    std::vector<float> vx, vy, vz; // Velocidade
+    std::vector<float> fx, fy, fz; // Força das molas
+    unsigned width = 0;             // Vizinhos por partícula (o maior grau)
+    size_t springs = 0;             // Arestas de que o ELL foi montado
+    std::vector<unsigned> neighbor; // Vizinhos em ordem crescente; a própria partícula nas sobras
+    std::vector<float> rest;        // Comprimento de repouso de cada mola (0 nas sobras, que dão força 0)
+
+    size_t size() const { return x.size(); }
+};
+
+// Monta o ELL a partir das arestas de C e dimensiona os vetores
+void buildClothSoA(const Cloth& C, ClothSoA& soa);
+// Copia posições e velocidades de C para os vetores SoA, em faixas no pool
+void loadClothSoA(const Cloth& C, ClothSoA& soa);
+// Forças das molas (as mesmas de computeSpringForces) em fx, fy, fz, em faixas no pool
+void computeSpringForces(ClothSoA& soa);
+
+// Normais por vértice do tecido para o desenho. A lista dos triângulos de cada
+// vértice é montada uma vez; a cada quadro as normais das faces são calculadas
+// e cada vértice soma as dos seus triângulos (gather), então as duas passadas
+// rodam em paralelo sem que uma faixa escreva no vértice de outra
+struct ClothNormals {
+    std::vector<unsigned> vertexStart;     // Triângulos do vértice i em [vertexStart[i], vertexStart[i + 1]) de vertexTriangles
+    std::vector<unsigned> vertexTriangles;
+    std::vector<glm::vec3> faceNormals;    // Produto vetorial das arestas: comprimento igual ao dobro da área
+    std::vector<glm::vec3> normals;        // Normal unitária de cada vértice, pronta para o VBO
+
+    size_t size() const { return normals.size(); }
+};
+
+// Monta a lista de triângulos por vértice a partir de C.triangles
+void buildClothNormals(const Cloth& C, ClothNormals& N);
+// Normais ponderadas pela área dos triângulos em N.normals, em faixas no pool.
+// Remonta a lista se o tecido mudou de tamanho
+void computeClothNormals(const Cloth& C, ClothNormals& N);
+
+enum class ClothIntegrator { Explicit, Implicit, XPBD };
+
+// Área de trabalho da simulação do tecido: guarda entre passos e quadros todos
+// os vetores temporários dos integradores e das colisões, então depois dos
+// primeiros passos a simulação não aloca mais memória
+struct ClothSolver {
+    ClothIntegrator integrator = ClothIntegrator::Explicit;
+
+    ClothSoA soa; // Integrador explícito
+    ClothImplicitSolver implicit;
+    ClothXPBDSolver xpbd;
+    ClothSelfCollision selfCollision;
+
+    // Colisão das arestas do tecido com a malha
+    std::vector<unsigned> nearTriangles, nearEdges;
+    std::vector<char> nearParticles;
+    std::vector<glm::vec3> edgeNormal;
+    std::vector<float> edgeDepth;
+    std::vector<std::vector<unsigned>> candidates; // Um vetor por faixa do parallelFor, nunca diminui
+};
+
+// Avança o tecido um passo com o integrador escolhido em solver
+void integrateCloth(Cloth& C, float dt, ClothSolver& solver);
 
 #endif // PHYSICS_HPP
\ No newline at end of file
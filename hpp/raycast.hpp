@@ -7,4 +7,50 @@ bool rayTriangleIntersect(const glm::vec3& orig, const glm::vec3& d,
                           const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2,
                           float& t, float& u, float& v);
 
+// Largura dos kernels vetoriais, escolhida na compilação:
+// AVX2 testa 8 lanes, SSE2 testa 4 e sem SIMD um laço escalar faz as mesmas 4 lanes
+#if defined(__AVX2__)
+constexpr int SIMD_WIDTH = 8;
+#else
+constexpr int SIMD_WIDTH = 4;
+#endif
+
+// Até SIMD_WIDTH triângulos em layout SoA (um vetor por componente).
+// Guarda v0 e as arestas já calculadas; lanes vazias ficam com arestas nulas
+// e nunca são atingidas
+struct alignas(32) TriangleBlock
+{
+    float v0x[SIMD_WIDTH] = {}, v0y[SIMD_WIDTH] = {}, v0z[SIMD_WIDTH] = {};
+    float e1x[SIMD_WIDTH] = {}, e1y[SIMD_WIDTH] = {}, e1z[SIMD_WIDTH] = {};
+    float e2x[SIMD_WIDTH] = {}, e2y[SIMD_WIDTH] = {}, e2z[SIMD_WIDTH] = {};
+    unsigned triangle[SIMD_WIDTH] = {}; // Índice do triângulo de cada lane
+    unsigned count{0};                  // Lanes ocupadas
+
+    // Coloca o triângulo (v0, v1, v2) na próxima lane livre
+    void push(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, unsigned id);
+    // Troca os vértices de uma lane já ocupada (malha deformada), mantendo o triângulo
+    void set(unsigned lane, const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2);
+};
+
+// SIMD_WIDTH raios coerentes (por exemplo, pixels vizinhos) em layout SoA
+struct alignas(32) RayPacket
+{
+    float ox[SIMD_WIDTH] = {}, oy[SIMD_WIDTH] = {}, oz[SIMD_WIDTH] = {};
+    float dx[SIMD_WIDTH] = {}, dy[SIMD_WIDTH] = {}, dz[SIMD_WIDTH] = {};
+
+    void set(int lane, const glm::vec3& orig, const glm::vec3& d);
+};
+
+// Um raio contra todos os triângulos do bloco. Retorna a lane do triângulo
+// mais próximo com t < tMax (preenchendo t, u, v) ou -1 se nenhum for atingido
+int rayTriangleBlockIntersect(const glm::vec3& orig, const glm::vec3& d,
+                              const TriangleBlock& block, float tMax,
+                              float& t, float& u, float& v);
+
+// Todos os raios do pacote contra um triângulo. Cada lane só é atualizada se
+// o triângulo estiver mais perto que t[lane]; retorna a máscara das lanes atualizadas
+unsigned rayPacketTriangleIntersect(const RayPacket& rays,
+                                    const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2,
+                                    float t[SIMD_WIDTH], float u[SIMD_WIDTH], float v[SIMD_WIDTH]);
+
 #endif
@@ -0,0 +1,89 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Pool of worker threads that run one job over a range of task indices.
+// The range is split into one contiguous slice per thread; a thread that
+// finishes its slice steals half of what is left in another thread's slice
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned threads = 0); // 0 uses every hardware thread
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Number of threads working on a job, the calling thread included
+    unsigned size() const { return static_cast<unsigned>(workers.size()) + 1; }
+
+    // Runs task(i) for every i in [0, count) and returns when all are done.
+    // Called from inside a task it runs serially on the current thread
+    void run(unsigned count, const std::function<void(unsigned)>& task);
+
+private:
+    // Remaining tasks of one thread: begin in the high 32 bits, end in the low
+    // 32 bits, so the owner and the thieves can update it with a single CAS
+    struct alignas(64) Slice
+    {
+        std::atomic<std::uint64_t> range{0};
+    };
+
+    void workerLoop(unsigned thread);
+    void work(unsigned thread);
+    bool popTask(unsigned thread, unsigned& task);
+    bool stealTask(unsigned thread, unsigned& task);
+
+    std::vector<std::thread> workers;
+    std::unique_ptr<Slice[]> slices;
+
+    const std::function<void(unsigned)>* job{nullptr};
+    std::mutex mutex;
+    std::condition_variable wake;     // A new job was posted or the pool is stopping
+    std::condition_variable finished; // The last worker finished the current job
+    unsigned generation{0};           // Incremented for every job
+    unsigned busy{0};                 // Workers still running the current job
+    bool stopping{false};
+};
+
+// Process-wide pool shared by the renderers and the parallel kernels
+ThreadPool& globalThreadPool();
+
+// Replaces the global pool with one of the given size (0 = every hardware thread).
+// Must not be called while a job is running
+void setThreadCount(unsigned threads);
+
+// Non-owning reference to a callable body(begin, end). Unlike std::function it
+// never allocates, so kernels that run every simulation step stay off the heap.
+// The callable must outlive the call it is passed to
+class RangeBody
+{
+public:
+    template <typename F>
+    RangeBody(const F& f)
+        : object(&f),
+          call([](const void* o, std::size_t begin, std::size_t end) { (*static_cast<const F*>(o))(begin, end); })
+    {}
+
+    void operator()(std::size_t begin, std::size_t end) const { call(object, begin, end); }
+
+private:
+    const void* object;
+    void (*call)(const void*, std::size_t, std::size_t);
+};
+
+// Runs body(begin, end) over [0, count) in chunks of grain elements.
+// The chunk boundaries depend only on count and grain, never on the number
+// of threads, so results merged per chunk come out the same on any machine
+void parallelFor(std::size_t count, std::size_t grain, RangeBody body);
+
+#endif
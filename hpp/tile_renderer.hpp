@@ -0,0 +1,20 @@
+#ifndef TILE_RENDERER_HPP
+#define TILE_RENDERER_HPP
+
+#include <functional>
+
+// Retângulo de pixels [x0, x1) x [y0, y1) renderizado como uma unidade de trabalho
+struct Tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+// Tamanho padrão do tile, 32x32 pixels cabem bem no cache
+constexpr int DEFAULT_TILE_SIZE = 32;
+
+// Divide a imagem width x height em tiles e renderiza cada um no pool global.
+// Cada pixel pertence a um único tile, então a imagem não depende do número de threads
+void renderTiles(int width, int height, int tileSize,
+                 const std::function<void(const Tile&)>& renderTile);
+
+#endif
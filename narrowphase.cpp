@@ -0,0 +1,296 @@
+#include "hpp/narrowphase.hpp"
+#include "hpp/thread_pool.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+namespace
+{
+    // A tree is at most 74 levels deep (see TRAVERSAL_STACK_SIZE in AABB.cpp).
+    // Every pop pushes at most two pairs that go one level down in one of the
+    // trees, so the stack never holds more than depth_a + depth_b + 1 pairs
+    constexpr int NODE_PAIR_STACK_SIZE = 160;
+
+    // Body pairs per task of the thread pool; a pair can cost thousands of node tests
+    constexpr size_t NARROW_PHASE_GRAIN = 8;
+
+    // Smallest squared length of a unit-edge cross product still used as an axis
+    // (edges less than about 0.01 degree apart are treated as parallel)
+    constexpr float MIN_AXIS_LENGTH_SQ = 1e-8f;
+
+    // Box that encloses box after rotation and translation (Arvo's method)
+    AABB transformBox(const AABB& box, const glm::mat3& rotation, const glm::vec3& translation)
+    {
+        glm::vec3 center = (box.min_corner + box.max_corner) * 0.5f;
+        glm::vec3 extent = (box.max_corner - box.min_corner) * 0.5f;
+        glm::mat3 abs_rotation(glm::abs(rotation[0]), glm::abs(rotation[1]), glm::abs(rotation[2]));
+
+        glm::vec3 new_center = rotation * center + translation;
+        glm::vec3 new_extent = abs_rotation * extent;
+        return AABB(new_center - new_extent, new_center + new_extent);
+    }
+
+    // Vertices and id of the i-th triangle of a leaf
+    unsigned leafTriangle(const AABBTree& tree, const LinearNode& leaf, unsigned i, glm::vec3 out[3])
+    {
+        unsigned triangle = tree.blocks[leaf.offset + i / SIMD_WIDTH].triangle[i % SIMD_WIDTH];
+        const auto& tri = tree.mesh.triangles[triangle];
+        for(int k = 0; k < 3; ++k) { out[k] = tree.mesh.coordinates[tri[k]]; }
+        return tree.mesh.ids[triangle];
+    }
+
+    AABB triangleBox(const glm::vec3 t[3])
+    {
+        return AABB(glm::min(t[0], glm::min(t[1], t[2])), glm::max(t[0], glm::max(t[1], t[2])));
+    }
+
+    void project(const glm::vec3 t[3], const glm::vec3& axis, float& min, float& max)
+    {
+        float p0 = glm::dot(t[0], axis), p1 = glm::dot(t[1], axis), p2 = glm::dot(t[2], axis);
+        min = std::min(p0, std::min(p1, p2));
+        max = std::max(p0, std::max(p1, p2));
+    }
+
+    // Tests every triangle of leaf_b (moved into a's space) against every triangle
+    // of leaf_a. Writes at most capacity - found contacts, returns the new count
+    unsigned collideLeaves(const AABBTree& a, const LinearNode& leaf_a,
+                           const AABBTree& b, const LinearNode& leaf_b,
+                           const glm::mat3& rotation, const glm::vec3& translation,
+                           Contact* out, unsigned found, unsigned capacity,
+                           NarrowPhaseStats& stats)
+    {
+        for(unsigned j = 0; j < leaf_b.count; ++j)
+        {
+            glm::vec3 tri_b[3];
+            unsigned face_b = leafTriangle(b, leaf_b, j, tri_b);
+            for(glm::vec3& v : tri_b) { v = rotation * v + translation; }
+            AABB box_b = triangleBox(tri_b);
+
+            for(unsigned i = 0; i < leaf_a.count; ++i)
+            {
+                glm::vec3 tri_a[3];
+                unsigned face_a = leafTriangle(a, leaf_a, i, tri_a);
+                if(!triangleBox(tri_a).overlaps(box_b)) { continue; }
+
+                ++stats.triangle_pairs;
+                Contact& contact = out[found];
+                if(triangleTriangleContact(tri_a, tri_b, contact))
+                {
+                    contact.face_a = face_a;
+                    contact.face_b = face_b;
+                    if(++found == capacity) { return found; }
+                }
+            }
+        }
+        return found;
+    }
+
+    // Dual-tree traversal in a's local space. Writes up to capacity contacts to
+    // out (in world space) and returns how many
+    unsigned collide(const AABBTree& a, const BodyTransform& transform_a,
+                     const AABBTree& b, const BodyTransform& transform_b,
+                     Contact* out, unsigned capacity,
+                     const NarrowPhaseOptions& options, NarrowPhaseStats& stats)
+    {
+        if(a.nodes.empty() || b.nodes.empty() || capacity == 0) { return 0; }
+
+        // b's local space -> a's local space. The rotations are orthonormal,
+        // so the inverse of a's rotation is its transpose
+        glm::mat3 to_a = glm::transpose(transform_a.rotation);
+        glm::mat3 rotation = to_a * transform_b.rotation;
+        glm::vec3 translation = to_a * (transform_b.position - transform_a.position);
+
+        unsigned found = 0;
+        std::pair<unsigned, unsigned> stack[NODE_PAIR_STACK_SIZE];
+        int top = 0;
+        stack[top++] = {0, 0};
+
+        while(top > 0)
+        {
+            if(stats.node_pairs == options.max_node_pairs)
+            {
+                stats.budget_exhausted = true;
+                break;
+            }
+            ++stats.node_pairs;
+
+            auto [index_a, index_b] = stack[--top];
+            const LinearNode& node_a = a.nodes[index_a];
+            const LinearNode& node_b = b.nodes[index_b];
+            if(!node_a.bounds().overlaps(transformBox(node_b.bounds(), rotation, translation))) { continue; }
+
+            if(node_a.isLeaf() && node_b.isLeaf())
+            {
+                found = collideLeaves(a, node_a, b, node_b, rotation, translation,
+                                      out, found, capacity, stats);
+                if(found == capacity) { break; }
+                continue;
+            }
+
+            // Split the bigger node, so both sides shrink at about the same rate
+            bool split_a = !node_a.isLeaf()
+                && (node_b.isLeaf() || node_a.bounds().surfaceArea() >= node_b.bounds().surfaceArea());
+            if(split_a)
+            {
+                stack[top++] = {node_a.offset, index_b};
+                stack[top++] = {index_a + 1, index_b};
+            }
+            else
+            {
+                stack[top++] = {index_a, node_b.offset};
+                stack[top++] = {index_a, index_b + 1};
+            }
+        }
+
+        for(unsigned i = 0; i < found; ++i)
+        {
+            out[i].point = transform_a.apply(out[i].point);
+            out[i].normal = transform_a.rotation * out[i].normal;
+        }
+        return found;
+    }
+}
+
+bool triangleTriangleContact(const glm::vec3 a[3], const glm::vec3 b[3], Contact& contact)
+{
+    glm::vec3 edges_a[3], edges_b[3];
+    for(int k = 0; k < 3; ++k)
+    {
+        edges_a[k] = a[(k + 1) % 3] - a[k];
+        edges_b[k] = b[(k + 1) % 3] - b[k];
+    }
+    glm::vec3 normal_a = glm::cross(edges_a[0], edges_a[1]);
+    glm::vec3 normal_b = glm::cross(edges_b[0], edges_b[1]);
+    if(glm::dot(normal_a, normal_a) == 0.0f || glm::dot(normal_b, normal_b) == 0.0f) { return false; }
+    normal_a = glm::normalize(normal_a);
+    normal_b = glm::normalize(normal_b);
+    for(int k = 0; k < 3; ++k)
+    {
+        // Unit edges keep the cross products comparable whatever the mesh scale
+        edges_a[k] = glm::normalize(edges_a[k]);
+        edges_b[k] = glm::normalize(edges_b[k]);
+    }
+
+    float best_depth = std::numeric_limits<float>::max();
+    glm::vec3 best_axis(0.0f);
+
+    // Projects both triangles on axis. Returns false if the axis separates them,
+    // otherwise keeps the direction that moves b out with the least travel
+    auto testAxis = [&](glm::vec3 axis)
+    {
+        float length_sq = glm::dot(axis, axis);
+        if(length_sq < MIN_AXIS_LENGTH_SQ) { return true; } // Parallel edges, no axis
+        axis /= std::sqrt(length_sq);
+
+        float min_a, max_a, min_b, max_b;
+        project(a, axis, min_a, max_a);
+        project(b, axis, min_b, max_b);
+        if(max_a < min_b || max_b < min_a) { return false; }
+
+        float forward = max_a - min_b;  // Moving b along +axis
+        float backward = max_b - min_a; // Moving b along -axis
+        if(forward < best_depth) { best_depth = forward; best_axis = axis; }
+        if(backward < best_depth) { best_depth = backward; best_axis = -axis; }
+        return true;
+    };
+
+    if(!testAxis(normal_a) || !testAxis(normal_b)) { return false; }
+    for(const glm::vec3& edge_a : edges_a)
+    {
+        for(const glm::vec3& edge_b : edges_b)
+        {
+            if(!testAxis(glm::cross(edge_a, edge_b))) { return false; }
+        }
+    }
+
+    // Coplanar triangles: the edge cross products all equal the normal, the
+    // in-plane edge normals separate them instead
+    glm::vec3 normals_cross = glm::cross(normal_a, normal_b);
+    if(glm::dot(normals_cross, normals_cross) < MIN_AXIS_LENGTH_SQ)
+    {
+        for(int k = 0; k < 3; ++k)
+        {
+            if(!testAxis(glm::cross(normal_a, edges_a[k]))) { return false; }
+            if(!testAxis(glm::cross(normal_a, edges_b[k]))) { return false; }
+        }
+    }
+
+    // Contact point: between the vertex of a that goes deepest along the normal
+    // and the vertex of b that goes deepest against it
+    glm::vec3 deepest_a = a[0], deepest_b = b[0];
+    for(int k = 1; k < 3; ++k)
+    {
+        if(glm::dot(a[k], best_axis) > glm::dot(deepest_a, best_axis)) { deepest_a = a[k]; }
+        if(glm::dot(b[k], best_axis) < glm::dot(deepest_b, best_axis)) { deepest_b = b[k]; }
+    }
+
+    contact.point = (deepest_a + deepest_b) * 0.5f;
+    contact.normal = best_axis;
+    contact.depth = best_depth;
+    return true;
+}
+
+bool collideTrees(const AABBTree& a, const BodyTransform& transform_a,
+                  const AABBTree& b, const BodyTransform& transform_b,
+                  std::vector<Contact>& contacts,
+                  const NarrowPhaseOptions& options,
+                  NarrowPhaseStats* stats)
+{
+    NarrowPhaseStats local_stats;
+    NarrowPhaseStats& work = stats ? *stats : local_stats;
+
+    size_t first = contacts.size();
+    contacts.resize(first + options.max_contacts);
+    unsigned found = collide(a, transform_a, b, transform_b, contacts.data() + first,
+                             options.max_contacts, options, work);
+    contacts.resize(first + found);
+    for(size_t i = first; i < contacts.size(); ++i)
+    {
+        contacts[i].body_a = 0;
+        contacts[i].body_b = 1;
+    }
+    return found > 0;
+}
+
+// Every pair owns max_contacts slots of a scratch buffer, so the tasks never
+// share output; the slots are then packed in pair order
+void narrowPhase(const std::vector<CollisionBody>& bodies,
+                 const std::vector<CollisionPair>& pairs,
+                 std::vector<Contact>& contacts,
+                 const NarrowPhaseOptions& options)
+{
+    contacts.clear();
+    const unsigned capacity = options.max_contacts;
+    if(pairs.empty() || capacity == 0) { return; }
+
+    std::vector<Contact> slots(pairs.size() * capacity);
+    std::vector<unsigned> counts(pairs.size(), 0);
+
+    parallelFor(pairs.size(), NARROW_PHASE_GRAIN, [&](size_t begin, size_t end) {
+        for(size_t p = begin; p < end; ++p)
+        {
+            const auto& [i, j] = pairs[p];
+            const CollisionBody& a = bodies[i];
+            const CollisionBody& b = bodies[j];
+            if(!a.tree || !b.tree) { continue; }
+
+            NarrowPhaseStats stats;
+            Contact* out = slots.data() + p * capacity;
+            counts[p] = collide(*a.tree, a.transform, *b.tree, b.transform,
+                                out, capacity, options, stats);
+            for(unsigned k = 0; k < counts[p]; ++k)
+            {
+                out[k].body_a = i;
+                out[k].body_b = j;
+            }
+        }
+    });
+
+    for(size_t p = 0; p < pairs.size(); ++p)
+    {
+        auto first = slots.begin() + p * capacity;
+        contacts.insert(contacts.end(), first, first + counts[p]);
+    }
+}
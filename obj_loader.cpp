@@ -1,43 +1,70 @@
 #include "obj_loader.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <iterator>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
 #include <glm/glm.hpp>
 #include <vector>
 #include <map>
 #include "hpp/physics.hpp" 
+#include "hpp/thread_pool.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // Função para calcular normal de face
 glm::vec3 computeFaceNormal(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2) {
     return glm::normalize(glm::cross(v1 - v0, v2 - v0));
 }
 
-// Função para calcular normais por vértice a partir de faces e vértices
+// Triângulos ou vértices por tarefa do pool no cálculo das normais
+static constexpr size_t TRIANGLE_GRAIN = 16384;
+
+// Função para calcular normais por vértice a partir dos triângulos. As
+// normais dos triângulos são calculadas em paralelo e somadas nos vértices em
+// sequência, na ordem dos triângulos, então o resultado é o mesmo com qualquer
+// número de threads
 void calculateNormalsFromVertices(const std::vector<glm::vec3>& vertices,
-                                  const std::vector<Face>& faces,
+                                  const std::vector<MeshData::triangle_t>& triangles,
                                   std::vector<glm::vec3>& normals) {
     normals.clear();
     normals.resize(vertices.size(), glm::vec3(0.0f));
 
-    for (const auto& face : faces) {
-        if (face.vertex_indices.size() < 3) continue;
-        glm::vec3 v0 = vertices[face.vertex_indices[0]];
-        glm::vec3 v1 = vertices[face.vertex_indices[1]];
-        glm::vec3 v2 = vertices[face.vertex_indices[2]];
-
-        glm::vec3 faceNormal = computeFaceNormal(v0, v1, v2);
+    std::vector<glm::vec3> triangleNormals(triangles.size());
+    parallelFor(triangles.size(), TRIANGLE_GRAIN, [&](size_t first, size_t last) {
+        for (size_t t = first; t < last; ++t) {
+            const auto& tri = triangles[t];
+            triangleNormals[t] = computeFaceNormal(vertices[tri[0]], vertices[tri[1]], vertices[tri[2]]);
+        }
+    });
 
-        for (auto vi : face.vertex_indices) {
-            normals[vi] += faceNormal;
+    for (size_t t = 0; t < triangles.size(); ++t) {
+        for (auto vi : triangles[t]) {
+            normals[vi] += triangleNormals[t];
         }
     }
 
-    for (auto& n : normals) {
-        if (glm::length(n) > 0.0f)
-            n = glm::normalize(n);
-        else
-            n = glm::vec3(0.0f, 1.0f, 0.0f); // normal padrão caso zero
-    }
+    parallelFor(normals.size(), TRIANGLE_GRAIN, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            glm::vec3& n = normals[i];
+            if (glm::length(n) > 0.0f)
+                n = glm::normalize(n);
+            else
+                n = glm::vec3(0.0f, 1.0f, 0.0f); // normal padrão caso zero
+        }
+    });
 }
 
 bool loadMTL(const std::string& mtlPath, std::map<std::string, Material>& materials) {
@@ -63,97 +90,565 @@ bool loadMTL(const std::string& mtlPath, std::map<std::string, Material>& materi
     return true;
 }
 
-bool loadOBJ_aux(const std::string& objPath,
-                    std::vector<glm::vec3>& out_vertices,
-                    std::vector<glm::vec3>& out_normals,
-                    std::vector<Face>& out_faces,
-                    std::map<std::string, Material>& out_materials)
-{
-    std::ifstream file(objPath);
-    if (!file.is_open()) return false;
+namespace {
 
-    std::string mtlFile;
-    std::vector<glm::vec3> temp_vertices, temp_normals;
-    std::string currentMaterial;
-    std::string line;
+// Arquivo inteiro visto como um bloco de memória: mapeado com mmap, sem cópia,
+// ou lido de uma vez nos sistemas sem mmap
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat info;
+        if (::fstat(fd, &info) == 0) {
+            size_ = static_cast<size_t>(info.st_size);
+            if (size_ == 0) {
+                open_ = true;
+            } else {
+                void* map = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (map != MAP_FAILED) {
+                    data_ = static_cast<const char*>(map);
+                    open_ = true;
+                    ::madvise(map, size_, MADV_SEQUENTIAL); // Lido uma vez, do começo ao fim
+                }
+            }
+        }
+        ::close(fd);
+#else
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) return;
+        contents_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data_ = contents_.data();
+        size_ = contents_.size();
+        open_ = true;
+#endif
+    }
 
-    while (std::getline(file, line)) {
-        std::istringstream ss(line);
-        std::string prefix;
-        ss >> prefix;
+    ~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (data_) ::munmap(const_cast<char*>(data_), size_);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const { return open_; }
+    const char* begin() const { return data_; }
+    const char* end() const { return data_ + size_; }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    bool open_ = false;
+#if !defined(__unix__) && !defined(__APPLE__)
+    std::string contents_;
+#endif
+};
+
+// Mesmos separadores que o operator>> dentro de uma linha (o '\r' cobre
+// arquivos salvos no Windows)
+inline bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+inline const char* skipBlanks(const char* p, const char* end) {
+    while (p < end && isBlank(*p)) ++p;
+    return p;
+}
+
+inline const char* tokenEnd(const char* p, const char* end) {
+    while (p < end && !isBlank(*p)) ++p;
+    return p;
+}
+
+// Próximo número do tipo T em [p, end), pulando os espaços e um '+' na frente,
+// que o from_chars não aceita. Avança p e retorna false se não houver número
+template <typename T>
+bool parseNumber(const char*& p, const char* end, T& value) {
+    p = skipBlanks(p, end);
+    if (p < end && *p == '+') ++p;
+    auto [next, error] = std::from_chars(p, end, value);
+    if (next == p) return false;
+    if (error == std::errc::result_out_of_range) value = T(0); // Fora do alcance de T (ex.: 1e-50 em float)
+    p = next;
+    return true;
+}
+
+// Três floats de uma linha "v" ou "vn"; os que faltarem ficam 0
+glm::vec3 parseVec3(const char* p, const char* end) {
+    glm::vec3 v(0.0f);
+    if (parseNumber(p, end, v.x) && parseNumber(p, end, v.y)) parseNumber(p, end, v.z);
+    return v;
+}
 
-        if (prefix == "mtllib") {
-            ss >> mtlFile;
-            loadMTL(mtlFile, out_materials);
-        } else if (prefix == "v") {
-            glm::vec3 v;
-            ss >> v.x >> v.y >> v.z;
-            temp_vertices.push_back(v);
-        } else if (prefix == "vn") {
-            glm::vec3 n;
-            ss >> n.x >> n.y >> n.z;
-            temp_normals.push_back(n);
-        } else if (prefix == "usemtl") {
-            ss >> currentMaterial;
-        } else if (prefix == "f") {
-            Face face;
-            face.material_name = currentMaterial;
-
-            std::string vertex_info;
-            while (ss >> vertex_info) {
-                size_t pos1 = vertex_info.find('/');
-                size_t pos2 = vertex_info.find_last_of('/');
-
-                unsigned int vi = std::stoi(vertex_info.substr(0, pos1)) - 1;
-
-                unsigned int ni = 0;
-                if (pos2 != std::string::npos && pos2 > pos1)
-                    ni = std::stoi(vertex_info.substr(pos2 + 1)) - 1;
-                else
-                    ni = 0; // default
-
-                face.vertex_indices.push_back(vi);
-                face.normal_indices.push_back(ni);
+// Bytes por trecho do arquivo; cada trecho é uma tarefa do pool
+constexpr size_t OBJ_CHUNK_BYTES = size_t(1) << 20;
+
+enum class LineType { Other, Vertex, Normal, Face, UseMaterial, MaterialLibrary };
+
+// Tipo da linha que começa em p; p passa para depois da palavra-chave
+LineType lineType(const char*& p, const char* lineEnd) {
+    p = skipBlanks(p, lineEnd);
+    const char* keyEnd = tokenEnd(p, lineEnd);
+    std::string_view prefix(p, keyEnd - p);
+    p = keyEnd;
+    if (prefix == "v") return LineType::Vertex;
+    if (prefix == "vn") return LineType::Normal;
+    if (prefix == "f") return LineType::Face;
+    if (prefix == "usemtl") return LineType::UseMaterial;
+    if (prefix == "mtllib") return LineType::MaterialLibrary;
+    return LineType::Other;
+}
+
+// Primeira palavra depois da palavra-chave (vazia se não houver)
+std::string_view firstToken(const char* p, const char* lineEnd) {
+    p = skipBlanks(p, lineEnd);
+    return std::string_view(p, tokenEnd(p, lineEnd) - p);
+}
+
+inline const char* findLineEnd(const char* p, const char* end) {
+    const char* lineEnd = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    return lineEnd ? lineEnd : end;
+}
+
+// Trecho do arquivo que começa e termina em fim de linha. A primeira passada
+// conta vértices, normais e triângulos e guarda o estado que passa para os
+// trechos seguintes (os usemtl); as somas de prefixo dão a posição de cada
+// trecho nos vetores de saída, e a segunda passada escreve direto nelas
+struct Chunk {
+    const char* begin;
+    const char* end;
+
+    size_t vertices = 0, normals = 0, triangles = 0;
+    std::vector<std::string_view> libraries; // mtllib do trecho, em ordem
+    std::vector<std::string_view> materials; // usemtl do trecho, em ordem
+
+    size_t vertexBase = 0, normalBase = 0, triangleBase = 0;
+    uint16_t material = 0; // Material em vigor no começo do trecho
+
+    std::string_view invalidFace; // Primeiro índice que não pôde ser lido
+
+    Chunk(const char* b, const char* e) : begin(b), end(e) {}
+};
+
+// Ids dos nomes de usemtl, montados em sequência entre as duas passadas e só
+// lidos na segunda
+using MaterialIds = std::unordered_map<std::string_view, uint16_t>;
+
+void countChunk(Chunk& chunk) {
+    for (const char* p = chunk.begin; p < chunk.end; ++p) {
+        const char* lineEnd = findLineEnd(p, chunk.end);
+        switch (lineType(p, lineEnd)) {
+        case LineType::Vertex: ++chunk.vertices; break;
+        case LineType::Normal: ++chunk.normals; break;
+        case LineType::Face: {
+            // Um polígono de n vértices vira n - 2 triângulos em leque
+            size_t corners = 0;
+            for (p = skipBlanks(p, lineEnd); p < lineEnd; p = skipBlanks(tokenEnd(p, lineEnd), lineEnd)) ++corners;
+            if (corners >= 3) chunk.triangles += corners - 2;
+            break;
+        }
+        case LineType::UseMaterial: {
+            std::string_view name = firstToken(p, lineEnd);
+            if (!name.empty()) chunk.materials.push_back(name);
+            break;
+        }
+        case LineType::MaterialLibrary: chunk.libraries.push_back(firstToken(p, lineEnd)); break;
+        default: break;
+        }
+        p = lineEnd;
+    }
+}
+
+// Índice de um vértice ou normal da face, contando a partir de 0. Os negativos
+// são relativos ao último lido até esta linha (-1 é o último), que é a base do
+// trecho mais os lidos no próprio trecho. Falha se o índice não aponta para um
+// elemento já lido (0, ou além do começo ou do fim), as mesmas regras com que o
+// cache é conferido
+inline bool resolveIndex(long long index, size_t base, size_t read, unsigned int& out) {
+    long long count = static_cast<long long>(base + read);
+    long long resolved = index < 0 ? count + index : index - 1;
+    if (resolved < 0 || resolved >= count) return false;
+    out = static_cast<unsigned int>(resolved);
+    return true;
+}
+
+void parseChunk(Chunk& chunk, const MaterialIds& materialIds, MeshData& mesh) {
+    size_t vertices = 0, normals = 0, triangles = 0;
+    uint16_t material = chunk.material;
+    std::vector<unsigned int> vertexIndices, normalIndices; // Cantos do polígono sendo lido
+
+    for (const char* p = chunk.begin; p < chunk.end; ++p) {
+        const char* lineEnd = findLineEnd(p, chunk.end);
+        switch (lineType(p, lineEnd)) {
+        case LineType::Vertex:
+            mesh.vertices[chunk.vertexBase + vertices++] = parseVec3(p, lineEnd);
+            break;
+        case LineType::Normal:
+            mesh.normals[chunk.normalBase + normals++] = parseVec3(p, lineEnd);
+            break;
+        case LineType::Face: {
+            vertexIndices.clear();
+            normalIndices.clear();
+
+            // Cada vértice é v, v/vt, v//vn ou v/vt/vn; a normal é o número
+            // depois da última barra, se houver duas
+            for (p = skipBlanks(p, lineEnd); p < lineEnd; p = skipBlanks(p, lineEnd)) {
+                const char* vertexEnd = tokenEnd(p, lineEnd);
+                long long vi = 0;
+                unsigned int ni = 0; // Sem normal: 0
+                const char* q = p;
+                bool valid = parseNumber(q, vertexEnd, vi);
+                const char* firstSlash = static_cast<const char*>(std::memchr(p, '/', vertexEnd - p));
+                const char* lastSlash = vertexEnd;
+                while (lastSlash > p && lastSlash[-1] != '/') --lastSlash;
+                if (valid && firstSlash && lastSlash - 1 > firstSlash) {
+                    long long n = 0;
+                    q = lastSlash;
+                    valid = parseNumber(q, vertexEnd, n) && resolveIndex(n, chunk.normalBase, normals, ni);
+                }
+                unsigned int vertex = 0;
+                valid = valid && resolveIndex(vi, chunk.vertexBase, vertices, vertex);
+                if (!valid) {
+                    if (chunk.invalidFace.empty()) chunk.invalidFace = std::string_view(p, vertexEnd - p);
+                    break;
+                }
+
+                vertexIndices.push_back(vertex);
+                normalIndices.push_back(ni);
+                p = vertexEnd;
             }
-            out_faces.push_back(face);
+
+            // Leque a partir do primeiro canto
+            for (size_t k = 2; k < vertexIndices.size(); ++k) {
+                size_t t = chunk.triangleBase + triangles++;
+                mesh.triangles[t] = {vertexIndices[0], vertexIndices[k - 1], vertexIndices[k]};
+                mesh.normalIndices[t] = {normalIndices[0], normalIndices[k - 1], normalIndices[k]};
+                mesh.materialIds[t] = material;
+            }
+            break;
+        }
+        case LineType::UseMaterial: {
+            std::string_view name = firstToken(p, lineEnd);
+            if (!name.empty()) material = materialIds.at(name);
+            break;
+        }
+        default: break;
         }
+        p = lineEnd;
     }
+}
+
+} // namespace
+
+// Percorre o arquivo mapeado com ponteiros, sem copiar linhas nem criar
+// streams, e com os números lidos direto do mapeamento com from_chars. O
+// arquivo é dividido em trechos terminados em fim de linha, lidos em paralelo
+// em duas passadas: a primeira conta as linhas e o estado de cada trecho, a
+// segunda escreve vértices, normais e triângulos nas posições que as somas de
+// prefixo deram, então o resultado não depende do número de threads
+bool loadOBJ_aux(const std::string& objPath, MeshData& mesh,
+                 std::vector<std::string>& out_libraries)
+{
+    MappedFile file(objPath);
+    if (!file.isOpen()) return false;
 
-    out_vertices = temp_vertices;
-    out_normals = temp_normals;
+    std::vector<Chunk> chunks;
+    size_t size = file.end() - file.begin();
+    size_t count = std::max<size_t>(1, size / OBJ_CHUNK_BYTES);
+    const char* begin = file.begin();
+    for (size_t k = 1; k <= count && begin < file.end(); ++k) {
+        const char* end = file.end();
+        if (k < count) {
+            const char* lineEnd = findLineEnd(std::max(begin, file.begin() + k * (size / count)), file.end());
+            end = lineEnd < file.end() ? lineEnd + 1 : lineEnd;
+        }
+        chunks.emplace_back(begin, end);
+        begin = end;
+    }
 
-    // Se não tem normais no OBJ, calcular
-    if (out_normals.empty()) {
-        calculateNormalsFromVertices(out_vertices, out_faces, out_normals);
-        // Atualiza os índices normais para serem iguais aos índices dos vértices
-        for (auto& face : out_faces) {
-            face.normal_indices.clear();
-            for (auto vi : face.vertex_indices) {
-                face.normal_indices.push_back(vi);
+    parallelFor(chunks.size(), 1, [&](size_t first, size_t last) {
+        for (size_t c = first; c < last; ++c) countChunk(chunks[c]);
+    });
+
+    // Somas de prefixo, os ids dos materiais na ordem em que aparecem e o
+    // material que cada trecho herda dos anteriores
+    size_t vertices = 0, normals = 0, triangles = 0;
+    MaterialIds materialIds{{std::string_view(), 0}};
+    mesh.materialNames.assign(1, std::string());
+    uint16_t material = 0;
+    for (Chunk& chunk : chunks) {
+        chunk.vertexBase = vertices;
+        chunk.normalBase = normals;
+        chunk.triangleBase = triangles;
+        chunk.material = material;
+        vertices += chunk.vertices;
+        normals += chunk.normals;
+        triangles += chunk.triangles;
+        for (std::string_view name : chunk.materials) {
+            auto [it, inserted] = materialIds.try_emplace(name, static_cast<uint16_t>(mesh.materialNames.size()));
+            if (inserted) {
+                if (mesh.materialNames.size() > UINT16_MAX) {
+                    std::cerr << "Materiais demais em " << objPath << std::endl;
+                    return false;
+                }
+                mesh.materialNames.emplace_back(name);
             }
+            material = it->second;
+        }
+        for (std::string_view library : chunk.libraries) {
+            out_libraries.emplace_back(library);
+            loadMTL(out_libraries.back(), mesh.materials);
         }
     }
+    mesh.vertices.assign(vertices, glm::vec3(0.0f));
+    mesh.normals.assign(normals, glm::vec3(0.0f));
+    mesh.triangles.resize(triangles);
+    mesh.normalIndices.resize(triangles);
+    mesh.materialIds.resize(triangles);
+
+    parallelFor(chunks.size(), 1, [&](size_t first, size_t last) {
+        for (size_t c = first; c < last; ++c) parseChunk(chunks[c], materialIds, mesh);
+    });
+
+    for (const Chunk& chunk : chunks) {
+        if (!chunk.invalidFace.empty()) {
+            std::cerr << "Face inválida em " << objPath << ": " << chunk.invalidFace << std::endl;
+            return false;
+        }
+    }
+
+    // Se não tem normais no OBJ, calcular. Os índices das normais passam a ser
+    // os dos vértices
+    if (mesh.normals.empty()) {
+        calculateNormalsFromVertices(mesh.vertices, mesh.triangles, mesh.normals);
+        mesh.normalIndices = mesh.triangles;
+    }
 
     return true;
 }
 
-bool loadOBJ(const std::string& objPath, PhysicalObject* object)
+namespace {
+
+// Tamanho e data de modificação de um arquivo de que a malha depende; um
+// arquivo que não existe fica com tamanho -1
+struct SourceStamp {
+    std::string path;
+    uint64_t size = ~uint64_t(0);
+    int64_t mtime = 0;
+};
+
+SourceStamp stampOf(const std::string& path) {
+    SourceStamp stamp;
+    stamp.path = path;
+    std::error_code error;
+    uint64_t size = std::filesystem::file_size(path, error);
+    if (error) return stamp;
+    auto mtime = std::filesystem::last_write_time(path, error);
+    if (error) return stamp;
+    stamp.size = size;
+    stamp.mtime = static_cast<int64_t>(mtime.time_since_epoch().count());
+    return stamp;
+}
+
+// Escreve no fim de um buffer os bytes de valores triviais, strings com o
+// tamanho na frente e vetores inteiros de uma vez
+class CacheWriter {
+public:
+    template <typename T>
+    void put(const T& value) { putBytes(&value, sizeof(T)); }
+    void putString(const std::string& s) {
+        put(static_cast<uint32_t>(s.size()));
+        putBytes(s.data(), s.size());
+    }
+    template <typename T>
+    void putArray(const std::vector<T>& values) { putBytes(values.data(), values.size() * sizeof(T)); }
+
+    const std::string& bytes() const { return bytes_; }
+
+private:
+    void putBytes(const void* data, size_t size) { bytes_.append(static_cast<const char*>(data), size); }
+    std::string bytes_;
+};
+
+// Lê na mesma ordem do CacheWriter, conferindo os limites: um cache truncado
+// ou corrompido só faz a leitura falhar
+class CacheReader {
+public:
+    CacheReader(const char* begin, const char* end) : p_(begin), end_(end) {}
+
+    template <typename T>
+    bool get(T& value) { return getBytes(&value, sizeof(T)); }
+    bool getString(std::string& s) {
+        uint32_t size = 0;
+        if (!get(size) || size_t(end_ - p_) < size) return false;
+        s.assign(p_, size);
+        p_ += size;
+        return true;
+    }
+    template <typename T>
+    bool getArray(std::vector<T>& values, uint64_t count) {
+        if (count > size_t(end_ - p_) / sizeof(T)) return false;
+        values.resize(count);
+        return getBytes(values.data(), count * sizeof(T));
+    }
+    bool atEnd() const { return p_ == end_; }
+
+private:
+    bool getBytes(void* data, size_t size) {
+        if (size_t(end_ - p_) < size) return false;
+        std::memcpy(data, p_, size);
+        p_ += size;
+        return true;
+    }
+    const char* p_;
+    const char* end_;
+};
+
+constexpr char MESH_CACHE_MAGIC[8] = {'M', 'E', 'S', 'H', 'C', 'A', 'C', 'H'};
+constexpr uint32_t MESH_CACHE_VERSION = 2; // 2: triângulos planos no lugar das faces
+
+static_assert(sizeof(glm::vec3) == 3 * sizeof(float), "vetores gravados como 3 floats");
+static_assert(sizeof(MeshData::triangle_t) == 3 * sizeof(uint32_t), "triângulos gravados como 3 uint32");
+static_assert(std::is_trivially_copyable_v<Material>, "materiais gravados byte a byte");
+
+// Cabeçalho do cache; os contadores dizem o tamanho dos vetores que vêm depois
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sources;       // O OBJ e os MTL que ele carrega
+    uint64_t vertices, normals, triangles;
+    uint32_t materials;     // Entradas do mapa de materiais
+    uint32_t materialNames; // Nomes de usemtl, indexados pelos ids dos triângulos
+};
+
+} // namespace
+
+std::string meshCachePath(const std::string& objPath) {
+    return objPath + ".meshcache";
+}
+
+// Layout: cabeçalho, fontes (caminho, tamanho, data), materiais (nome e
+// Material), nomes de usemtl, e então os vetores planos da malha: vértices,
+// normais, triângulos, índices de normal e o id de material de cada triângulo
+bool writeMeshCache(const std::string& cachePath, const MeshData& mesh,
+                    const std::vector<std::string>& sources) {
+    MeshCacheHeader header{};
+    std::memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = MESH_CACHE_VERSION;
+    header.sources = static_cast<uint32_t>(sources.size());
+    header.vertices = mesh.vertices.size();
+    header.normals = mesh.normals.size();
+    header.triangles = mesh.triangles.size();
+    header.materials = static_cast<uint32_t>(mesh.materials.size());
+    header.materialNames = static_cast<uint32_t>(mesh.materialNames.size());
+
+    CacheWriter out;
+    out.put(header);
+    for (const std::string& source : sources) {
+        SourceStamp stamp = stampOf(source);
+        out.putString(stamp.path);
+        out.put(stamp.size);
+        out.put(stamp.mtime);
+    }
+    for (const auto& [name, material] : mesh.materials) {
+        out.putString(name);
+        out.put(material);
+    }
+    for (const std::string& name : mesh.materialNames) out.putString(name);
+    out.putArray(mesh.vertices);
+    out.putArray(mesh.normals);
+    out.putArray(mesh.triangles);
+    out.putArray(mesh.normalIndices);
+    out.putArray(mesh.materialIds);
+
+    // Escrito num temporário e renomeado, para outro processo nunca ler um
+    // cache pela metade
+    std::string temporary = cachePath + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        if (!file.write(out.bytes().data(), out.bytes().size())) return false;
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, cachePath, error);
+    if (error) std::filesystem::remove(temporary, error);
+    return !error;
+}
+
+// Lê o cache mapeado em memória. Falha se ele não existe, é de outra versão,
+// está corrompido ou se o OBJ ou algum MTL mudou desde que foi escrito. Os
+// vetores da malha são copiados inteiros do mapeamento, sem parsing
+bool loadMeshCache(const std::string& cachePath, const std::string& objPath, MeshData& mesh) {
+    MappedFile file(cachePath);
+    if (!file.isOpen()) return false;
+    CacheReader in(file.begin(), file.end());
+
+    MeshCacheHeader header;
+    if (!in.get(header) || std::memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != MESH_CACHE_VERSION || header.sources == 0 || header.materialNames == 0) return false;
+
+    for (uint32_t i = 0; i < header.sources; ++i) {
+        SourceStamp stored;
+        if (!in.getString(stored.path) || !in.get(stored.size) || !in.get(stored.mtime)) return false;
+        if (i == 0 && stored.path != objPath) return false;
+        SourceStamp current = stampOf(stored.path);
+        if (current.size != stored.size || current.mtime != stored.mtime) return false;
+    }
+
+    MeshData loaded;
+    for (uint32_t i = 0; i < header.materials; ++i) {
+        std::string name;
+        Material material;
+        if (!in.getString(name) || !in.get(material)) return false;
+        loaded.materials[name] = material;
+    }
+    loaded.materialNames.resize(header.materialNames);
+    for (std::string& name : loaded.materialNames) {
+        if (!in.getString(name)) return false;
+    }
+
+    if (!in.getArray(loaded.vertices, header.vertices) || !in.getArray(loaded.normals, header.normals)
+        || !in.getArray(loaded.triangles, header.triangles) || !in.getArray(loaded.normalIndices, header.triangles)
+        || !in.getArray(loaded.materialIds, header.triangles) || !in.atEnd()) return false;
+
+    // Índices fora dos vetores só apareceriam num cache corrompido
+    for (size_t t = 0; t < loaded.triangles.size(); ++t) {
+        for (unsigned v : loaded.triangles[t]) {
+            if (v >= loaded.vertices.size()) return false;
+        }
+        for (unsigned n : loaded.normalIndices[t]) {
+            if (n >= loaded.normals.size()) return false;
+        }
+        if (loaded.materialIds[t] >= loaded.materialNames.size()) return false;
+    }
+
+    mesh = std::move(loaded);
+    return true;
+}
+
+bool loadOBJ(const std::string& objPath, PhysicalObject* object, bool useCache)
 {
-    std::vector<glm::vec3> vertices, normals;
-    std::vector<Face> faces;
-    std::map<std::string, Material> materials;
+    auto mesh = std::make_shared<MeshData>();
+    std::string cachePath = meshCachePath(objPath);
+    if (useCache && loadMeshCache(cachePath, objPath, *mesh)) {
+        object->mesh = std::move(mesh);
+        return true;
+    }
 
-    bool success = loadOBJ_aux(objPath, vertices, normals, faces, materials);
-    if (!success) {
+    std::vector<std::string> libraries;
+    if (!loadOBJ_aux(objPath, *mesh, libraries)) {
         std::cerr << "Erro ao carregar OBJ: " << objPath << std::endl;
         return false;
     }
 
-    object->vertices = vertices;
-    object->normals = normals;
-    object->faces = faces;
-    object->materials = materials;
+    // Sem permissão de escrita a malha só não fica em cache
+    if (useCache) {
+        libraries.insert(libraries.begin(), objPath);
+        writeMeshCache(cachePath, *mesh, libraries);
+    }
 
+    object->mesh = std::move(mesh);
     return true;
 }
-
@@ -5,6 +5,8 @@
 #include <map>
 #include <vector>
 #include "hpp/physics.hpp"
+#include "hpp/thread_pool.hpp"
+#include "hpp/AABB.hpp"
 #include <cmath>
 #include <string>
 #include <algorithm>
@@ -75,6 +77,113 @@ void applyTornadoForce(PhysicalObject* obj, glm::vec3 center, double dt) {
     }
 }
 
+void RigidBodySoA::resize(size_t n) {
+    for (auto* field : {&px, &py, &pz, &vx, &vy, &vz, &mass, &drag, &area}) field->resize(n, 0.0);
+}
+
+size_t RigidBodySoA::add(const PhysicalObject& obj) {
+    size_t i = size();
+    resize(i + 1);
+    setPosition(i, obj.position);
+    setVelocity(i, obj.velocity);
+    mass[i] = obj.mass;
+    drag[i] = obj.dragCoefficient;
+    area[i] = obj.frontalArea;
+    return i;
+}
+
+RigidBodySpan bodySpan(RigidBodySoA& b, size_t begin, size_t end) {
+    return {b.px.data() + begin, b.py.data() + begin, b.pz.data() + begin,
+            b.vx.data() + begin, b.vy.data() + begin, b.vz.data() + begin,
+            b.mass.data() + begin, b.drag.data() + begin, b.area.data() + begin,
+            end - begin};
+}
+
+// Gravidade e arrasto do ar, como update_ambient_forces. O teste speed > 0 some:
+// vhat * (-0.5 rho |v|^2 Cd A) = v * (-0.5 rho |v| Cd A), que já é zero parado.
+// Os ponteiros restrict como parâmetros deixam o compilador vetorizar sem checar aliasing
+static void ambientKernel(double* __restrict px, double* __restrict py, double* __restrict pz,
+                          double* __restrict vx, double* __restrict vy, double* __restrict vz,
+                          const double* __restrict mass, const double* __restrict drag,
+                          const double* __restrict area, size_t count, double dt) {
+    const double gx = G.x, gy = G.y, gz = G.z;
+    for (size_t i = 0; i < count; ++i) {
+        double speed = std::sqrt(vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i]);
+        double air = -0.5 * AIR_DENSITY * speed * drag[i] * area[i];
+
+        double ax = (gx * mass[i] + vx[i] * air) / mass[i];
+        double ay = (gy * mass[i] + vy[i] * air) / mass[i];
+        double az = (gz * mass[i] + vz[i] * air) / mass[i];
+
+        vx[i] += ax * dt; vy[i] += ay * dt; vz[i] += az * dt;
+        px[i] += vx[i] * dt; py[i] += vy[i] * dt; pz[i] += vz[i] * dt;
+    }
+}
+
+// Forças do tornado, como applyTornadoForce, mas todo em double: misturar
+// float e double impede a vetorização. Os "if" viram seleções (std::max em vez
+// de std::fmax, que não tem versão vetorial) e os corpos sobre o eixo (sem
+// direção definida) não recebem força
+static void tornadoKernel(const double* __restrict px, const double* __restrict py,
+                          const double* __restrict pz,
+                          double* __restrict vx, double* __restrict vy, double* __restrict vz,
+                          size_t count, glm::dvec3 center, double dt) {
+    const double maxRadius = 6.0;
+    const double inwardStrength = 10.0;
+    const double spiralStrength = 10.0;
+    const double liftStrength = 10.0;
+    const double cx = center.x, cy = center.y, cz = center.z;
+
+    for (size_t i = 0; i < count; ++i) {
+        double tx = cx - px[i];
+        double ty = cy - py[i];
+        double tz = cz - pz[i];
+        double dist = std::sqrt(tx * tx + ty * ty + tz * tz);
+        double spiralLen = std::sqrt(tz * tz + tx * tx); // |toCenter x (0,1,0)|
+
+        double active = dist >= 0.00001 ? 1.0 : 0.0;
+        double invDist = active / std::max(dist, 0.00001);
+        double invSpiral = active / std::max(spiralLen, 1e-300);
+
+        // Para dentro, em espiral no plano XZ, para cima e, fora do raio máximo, de volta
+        double pull = inwardStrength + std::max(dist - maxRadius, 0.0) * 20.0;
+        double nvx = vx[i] + (tx * invDist * pull - tz * invSpiral * spiralStrength) * dt;
+        double nvy = vy[i] + (ty * invDist * pull + liftStrength * active) * dt;
+        double nvz = vz[i] + (tz * invDist * pull + tx * invSpiral * spiralStrength) * dt;
+
+        // Freio radial na velocidade que sai do centro
+        double rx = tx * invDist, ry = ty * invDist, rz = tz * invDist;
+        double radialSpeed = -(nvx * rx + nvy * ry + nvz * rz);
+        double brake = std::max(radialSpeed, 0.0) * 2.0;
+        vx[i] = nvx - rx * brake * dt;
+        vy[i] = nvy - ry * brake * dt;
+        vz[i] = nvz - rz * brake * dt;
+    }
+}
+
+void integrateAmbient(const RigidBodySpan& b, double dt) {
+    ambientKernel(b.px, b.py, b.pz, b.vx, b.vy, b.vz, b.mass, b.drag, b.area, b.count, dt);
+}
+
+void applyTornado(const RigidBodySpan& b, glm::vec3 center, double dt) {
+    tornadoKernel(b.px, b.py, b.pz, b.vx, b.vy, b.vz, b.count, glm::dvec3(center), dt);
+}
+
+// Corpos por tarefa do pool; fixo para a divisão não depender do número de threads
+static constexpr size_t BODY_GRAIN = 16384;
+
+void integrateAmbient(RigidBodySoA& bodies, double dt) {
+    parallelFor(bodies.size(), BODY_GRAIN, [&](size_t begin, size_t end) {
+        integrateAmbient(bodySpan(bodies, begin, end), dt);
+    });
+}
+
+void applyTornado(RigidBodySoA& bodies, glm::vec3 center, double dt) {
+    parallelFor(bodies.size(), BODY_GRAIN, [&](size_t begin, size_t end) {
+        applyTornado(bodySpan(bodies, begin, end), center, dt);
+    });
+}
+
 // Cria o tecido
 void createCloth(Cloth &cloth, int nFaces,
                  float spacing = 1.0f,
@@ -86,6 +195,7 @@ void createCloth(Cloth &cloth, int nFaces,
     cloth.velocities.clear();
     cloth.edges.clear();
     cloth.restLengths.clear();
+    cloth.triangles.clear();
 
     // Calcular o grid do tecido, considerando que cada face é um quadrado
     int quads = nFaces / 2;
@@ -127,6 +237,15 @@ void createCloth(Cloth &cloth, int nFaces,
         }
     }
 
+    // Triângulos da superfície, usados só pelas consultas de colisão
+    for (int y = 0; y < gridSize; ++y) {
+        for (int x = 0; x < gridSize; ++x) {
+            unsigned a = idx(x, y), b = idx(x + 1, y), c = idx(x + 1, y + 1), d = idx(x, y + 1);
+            cloth.triangles.push_back({a, b, c});
+            cloth.triangles.push_back({a, c, d});
+        }
+    }
+
     cloth.restLengths.reserve(cloth.edges.size());
     for (auto &e : cloth.edges) {
         int i = e.first;
@@ -137,9 +256,14 @@ void createCloth(Cloth &cloth, int nFaces,
 }
 
 
+// Molas e gravidade do tecido, as mesmas nos integradores explícito e implícito
+static constexpr float SPRING_STIFFNESS = 100.0f;
+static constexpr float SPRING_DAMPING = 1.5f;
+static const glm::vec3 CLOTH_GRAVITY(0.0f, -0.98f, 0.0f);
+
 // Determina o damping e a força elástica para cada aresta do tecido
 void computeSpringForces(const Cloth& C, std::vector<glm::vec3>& F) {
-  float ks=100.f, kd=1.5f;
+  float ks=SPRING_STIFFNESS, kd=SPRING_DAMPING;
   int M = C.edges.size();
   for(int k=0; k<M; ++k){
     auto [i,j] = C.edges[k];
@@ -157,7 +281,7 @@ void computeSpringForces(const Cloth& C, std::vector<glm::vec3>& F) {
 // Aplica gravidade no tecido (vento removido)
 void applyExternalForces(const Cloth& C, std::vector<glm::vec3>& F) {
   int N=C.positions.size();
-  glm::vec3 g(0,-0.98f,0);
+  glm::vec3 g = CLOTH_GRAVITY;
   for(int i=0;i<N;++i){
     F[i] += g * C.mass;
     // wind randômico
@@ -169,17 +293,601 @@ void applyExternalForces(const Cloth& C, std::vector<glm::vec3>& F) {
   }
 }
 
-// Integrador RK4
-void integrateCloth(Cloth& C, float dt){
-  int N=C.positions.size();
-  std::vector<glm::vec3> F(N), a(N);
-  computeSpringForces(C, F);
-  applyExternalForces(C, F);
-  for(int i=0;i<N;++i){
-    a[i] = F[i] / C.mass;
-    C.velocities[i] += a[i] * dt;
-    C.positions[i]  += C.velocities[i] * dt;
-  }
+// Partículas (linhas) ou molas por tarefa do pool no passo implícito
+static constexpr size_t IMPLICIT_GRAIN = 4096;
+
+// Soma os valores que body(begin, end) devolve para cada faixa de IMPLICIT_GRAIN
+// itens. As faixas não dependem do número de threads e são somadas em ordem,
+// então o resultado também não
+template <typename Body>
+static double sumChunks(size_t count, std::vector<double>& partial, Body body) {
+    partial.resize((count + IMPLICIT_GRAIN - 1) / IMPLICIT_GRAIN);
+    parallelFor(count, IMPLICIT_GRAIN, [&](size_t begin, size_t end) {
+        partial[begin / IMPLICIT_GRAIN] = body(begin, end);
+    });
+    double sum = 0.0;
+    for (double value : partial) sum += value;
+    return sum;
+}
+
+// Estrutura block-CSR a partir das arestas: a mola k = (i, j) gera os blocos (i, j) e (j, i)
+static void buildImplicitStructure(const Cloth& C, ClothImplicitSolver& s) {
+    size_t n = C.positions.size();
+    size_t m = C.edges.size();
+    s.rowStart.assign(n + 1, 0);
+    for (const auto& [i, j] : C.edges) {
+        ++s.rowStart[i + 1];
+        ++s.rowStart[j + 1];
+    }
+    for (size_t i = 1; i <= n; ++i) s.rowStart[i] += s.rowStart[i - 1];
+
+    std::vector<unsigned> next(s.rowStart.begin(), s.rowStart.end() - 1);
+    s.column.resize(2 * m);
+    s.blockEdge.resize(2 * m);
+    for (unsigned k = 0; k < m; ++k) {
+        auto [i, j] = C.edges[k];
+        s.column[next[i]] = j;
+        s.blockEdge[next[i]++] = k;
+        s.column[next[j]] = i;
+        s.blockEdge[next[j]++] = k;
+    }
+
+    s.blocks.resize(2 * m);
+    s.diagonal.resize(n);
+    s.preconditioner.resize(n);
+    s.springForce.resize(m);
+    s.stiffness.resize(m);
+    s.damping.resize(m);
+    s.rhs.resize(n);
+    s.dv.assign(n, glm::vec3(0.0f)); // Sem passo anterior, o CG parte do zero
+    s.r.resize(n);
+    s.z.resize(n);
+    s.p.resize(n);
+    s.Ap.resize(n);
+}
+
+// y = A x, devolvendo x·y para o CG
+static double multiplyImplicit(ClothImplicitSolver& s, const std::vector<glm::vec3>& x, std::vector<glm::vec3>& y) {
+    return sumChunks(x.size(), s.partial, [&](size_t begin, size_t end) {
+        double xy = 0.0;
+        for (size_t i = begin; i < end; ++i) {
+            glm::vec3 sum = s.diagonal[i] * x[i];
+            for (unsigned b = s.rowStart[i]; b < s.rowStart[i + 1]; ++b) sum += s.blocks[b] * x[s.column[b]];
+            y[i] = sum;
+            xy += glm::dot(x[i], sum);
+        }
+        return xy;
+    });
+}
+
+// Com d = xj - xi, l = |d| e n = d / l, a mola puxa i com ks (l - l0) n + kd ((vj - vi)·n) n.
+// As derivadas em relação a xj e vj são K = ks (n nᵀ + (1 - l0/l)(I - n nᵀ)) e
+// D = kd n nᵀ; em relação a xi e vi trocam de sinal. Numa mola comprimida o termo
+// transversal some (1 - l0/l vira 0) para a matriz continuar definida positiva,
+// o que o CG exige
+void integrateClothImplicit(Cloth& C, float dt, ClothImplicitSolver& s) {
+    size_t n = C.positions.size();
+    size_t m = C.edges.size();
+    if (n == 0) return;
+    if (s.rowStart.size() != n + 1 || s.column.size() != 2 * m) buildImplicitStructure(C, s);
+
+    parallelFor(m, IMPLICIT_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; ++k) {
+            auto [i, j] = C.edges[k];
+            glm::vec3 d = C.positions[j] - C.positions[i];
+            float len = glm::length(d);
+            if (len < 1e-8f) {
+                s.springForce[k] = glm::vec3(0.0f);
+                s.stiffness[k] = glm::mat3(0.0f);
+                s.damping[k] = glm::mat3(0.0f);
+                continue;
+            }
+            glm::vec3 dir = d / len;
+            glm::mat3 nn = glm::outerProduct(dir, dir);
+            float stretch = std::max(0.0f, 1.0f - C.restLengths[k] / len);
+            float vn = glm::dot(C.velocities[j] - C.velocities[i], dir);
+
+            s.springForce[k] = (SPRING_STIFFNESS * (len - C.restLengths[k]) + SPRING_DAMPING * vn) * dir;
+            s.stiffness[k] = SPRING_STIFFNESS * (nn + stretch * (glm::mat3(1.0f) - nn));
+            s.damping[k] = SPRING_DAMPING * nn;
+        }
+    });
+
+    // Cada linha monta os próprios blocos e o lado direito, então as linhas
+    // rodam em paralelo sem escrever nas outras
+    parallelFor(n, IMPLICIT_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            glm::vec3 force = C.mass * CLOTH_GRAVITY;
+            glm::vec3 stiffnessTimesV(0.0f);
+            glm::mat3 diagonal(C.mass);
+            for (unsigned b = s.rowStart[i]; b < s.rowStart[i + 1]; ++b) {
+                unsigned k = s.blockEdge[b];
+                force += (C.edges[k].first == int(i)) ? s.springForce[k] : -s.springForce[k];
+                stiffnessTimesV += s.stiffness[k] * (C.velocities[s.column[b]] - C.velocities[i]);
+
+                glm::mat3 block = dt * s.damping[k] + (dt * dt) * s.stiffness[k];
+                s.blocks[b] = -block;
+                diagonal += block;
+            }
+            s.rhs[i] = dt * (force + dt * stiffnessTimesV);
+            s.diagonal[i] = diagonal;
+            s.preconditioner[i] = glm::inverse(diagonal);
+        }
+    });
+
+    // Gradiente conjugado pré-condicionado, partindo do dv do passo anterior:
+    // a aceleração muda pouco de um passo para o outro
+    std::vector<glm::vec3>& x = s.dv;
+    multiplyImplicit(s, x, s.Ap);
+    double rhsNorm = sumChunks(n, s.partial, [&](size_t begin, size_t end) {
+        double sum = 0.0;
+        for (size_t i = begin; i < end; ++i) sum += glm::dot(s.rhs[i], s.preconditioner[i] * s.rhs[i]);
+        return sum;
+    });
+    double rz = sumChunks(n, s.partial, [&](size_t begin, size_t end) {
+        double sum = 0.0;
+        for (size_t i = begin; i < end; ++i) {
+            s.r[i] = s.rhs[i] - s.Ap[i];
+            s.z[i] = s.preconditioner[i] * s.r[i];
+            s.p[i] = s.z[i];
+            sum += glm::dot(s.r[i], s.z[i]);
+        }
+        return sum;
+    });
+
+    const double target = double(s.tolerance) * s.tolerance * rhsNorm;
+    s.iterations = 0;
+    while (s.iterations < s.maxIterations && rz > target) {
+        double pAp = multiplyImplicit(s, s.p, s.Ap);
+        if (pAp <= 0.0) break;
+        float alpha = float(rz / pAp);
+        double rzNext = sumChunks(n, s.partial, [&](size_t begin, size_t end) {
+            double sum = 0.0;
+            for (size_t i = begin; i < end; ++i) {
+                x[i] += alpha * s.p[i];
+                s.r[i] -= alpha * s.Ap[i];
+                s.z[i] = s.preconditioner[i] * s.r[i];
+                sum += glm::dot(s.r[i], s.z[i]);
+            }
+            return sum;
+        });
+        float beta = float(rzNext / rz);
+        rz = rzNext;
+        parallelFor(n, IMPLICIT_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) s.p[i] = s.z[i] + beta * s.p[i];
+        });
+        ++s.iterations;
+    }
+    s.residual = rhsNorm > 0.0 ? float(std::sqrt(rz / rhsNorm)) : 0.0f;
+
+    parallelFor(n, IMPLICIT_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            C.velocities[i] += x[i];
+            C.positions[i] += C.velocities[i] * dt;
+        }
+    });
+}
+
+
+
+// Arestas de uma cor ou partículas por tarefa do pool no XPBD
+static constexpr size_t XPBD_GRAIN = 2048;
+
+// Coloração gulosa: cada aresta, na ordem, pega a menor cor que nenhuma aresta
+// já colorida das suas duas partículas usa. Depois as arestas são agrupadas por
+// cor com counting sort, mantendo a ordem original dentro de cada cor
+static void colorEdges(const Cloth& C, ClothXPBDSolver& s) {
+    size_t n = C.positions.size();
+    size_t m = C.edges.size();
+    const unsigned NONE = ~0u;
+
+    std::vector<unsigned> incidentStart(n + 1, 0), incident(2 * m);
+    for (const auto& [i, j] : C.edges) {
+        ++incidentStart[i + 1];
+        ++incidentStart[j + 1];
+    }
+    for (size_t i = 1; i <= n; ++i) incidentStart[i] += incidentStart[i - 1];
+    std::vector<unsigned> next(incidentStart.begin(), incidentStart.end() - 1);
+    for (unsigned k = 0; k < m; ++k) {
+        incident[next[C.edges[k].first]++] = k;
+        incident[next[C.edges[k].second]++] = k;
+    }
+
+    // taken[c] == k + 1 marca a cor c como usada por um vizinho da aresta k,
+    // sem precisar limpar o vetor entre as arestas
+    std::vector<unsigned> color(m, NONE), taken;
+    for (unsigned k = 0; k < m; ++k) {
+        for (int v : {C.edges[k].first, C.edges[k].second}) {
+            for (unsigned e = incidentStart[v]; e < incidentStart[v + 1]; ++e) {
+                unsigned c = color[incident[e]];
+                if (c != NONE) taken[c] = k + 1;
+            }
+        }
+        unsigned c = 0;
+        while (c < taken.size() && taken[c] == k + 1) ++c;
+        if (c == taken.size()) taken.push_back(0);
+        color[k] = c;
+    }
+
+    s.colorStart.assign(taken.size() + 1, 0);
+    for (unsigned c : color) ++s.colorStart[c + 1];
+    for (size_t c = 1; c < s.colorStart.size(); ++c) s.colorStart[c] += s.colorStart[c - 1];
+    next.assign(s.colorStart.begin(), s.colorStart.end() - 1);
+    s.order.resize(m);
+    for (unsigned k = 0; k < m; ++k) s.order[next[color[k]]++] = k;
 }
 
+// Prevê as posições só com a gravidade e projeta as restrições cor por cor
+// (Gauss-Seidel entre cores, em paralelo dentro de cada uma). Com α = compliance / dt²,
+// cada projeção faz Δλ = (-C - α λ) / (w_i + w_j + α), onde C = |x_i - x_j| - l0;
+// a velocidade sai da diferença de posições no fim
+void integrateClothXPBD(Cloth& C, float dt, ClothXPBDSolver& s) {
+    size_t n = C.positions.size();
+    size_t m = C.edges.size();
+    if (n == 0 || dt <= 0.0f) return;
+    if (s.order.size() != m) colorEdges(C, s);
 
+    s.previous.resize(n);
+    parallelFor(n, XPBD_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            s.previous[i] = C.positions[i];
+            C.velocities[i] += CLOTH_GRAVITY * dt;
+            C.positions[i] += C.velocities[i] * dt;
+        }
+    });
+
+    const float w = 1.0f / C.mass; // Todas as partículas têm a mesma massa
+    const float alpha = s.compliance / (dt * dt);
+    s.lambda.assign(m, 0.0f);
+    for (int iteration = 0; iteration < s.iterations; ++iteration) {
+        for (size_t c = 0; c < s.colors(); ++c) {
+            const unsigned first = s.colorStart[c];
+            parallelFor(s.colorStart[c + 1] - first, XPBD_GRAIN, [&](size_t begin, size_t end) {
+                for (size_t e = first + begin; e < first + end; ++e) {
+                    unsigned k = s.order[e];
+                    auto [i, j] = C.edges[k];
+                    glm::vec3 d = C.positions[i] - C.positions[j];
+                    float len = glm::length(d);
+                    if (len < 1e-8f) continue;
+
+                    float constraint = len - C.restLengths[k];
+                    float delta = (-constraint - alpha * s.lambda[k]) / (2.0f * w + alpha);
+                    s.lambda[k] += delta;
+                    glm::vec3 correction = (delta * w / len) * d;
+                    C.positions[i] += correction;
+                    C.positions[j] -= correction;
+                }
+            });
+        }
+    }
+
+    const float invDt = 1.0f / dt;
+    parallelFor(n, XPBD_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) C.velocities[i] = (C.positions[i] - s.previous[i]) * invDt;
+    });
+}
+
+
+
+// Partículas ou triângulos por tarefa do pool na autocolisão
+static constexpr size_t SELF_COLLISION_GRAIN = 2048;
+
+static unsigned hashCell(const glm::ivec3& c, unsigned tableSize) {
+    unsigned h = (unsigned(c.x) * 73856093u) ^ (unsigned(c.y) * 19349663u) ^ (unsigned(c.z) * 83492791u);
+    return h & (tableSize - 1);
+}
+
+// Põe cada triângulo nas células da sua caixa e agrupa as entradas por posição
+// na tabela com counting sort: conta, soma de prefixos e espalha. Depois de
+// espalhar, start[h] aponta para o fim da posição h, e andar uma posição
+// devolve os inícios
+static void buildTriangleGrid(ClothSelfCollision& s, float invCellSize) {
+    size_t nTriangles = s.boxMin.size();
+    s.firstEntry.resize(nTriangles + 1);
+    parallelFor(nTriangles, SELF_COLLISION_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t t = begin; t < end; ++t) {
+            glm::ivec3 lo(glm::floor(s.boxMin[t] * invCellSize)), hi(glm::floor(s.boxMax[t] * invCellSize));
+            glm::ivec3 cells = hi - lo + 1;
+            s.firstEntry[t + 1] = unsigned(cells.x * cells.y * cells.z);
+        }
+    });
+    s.firstEntry[0] = 0;
+    for (size_t t = 0; t < nTriangles; ++t) s.firstEntry[t + 1] += s.firstEntry[t];
+
+    unsigned entries = s.firstEntry[nTriangles];
+    unsigned tableSize = 1; // Potência de 2 com pelo menos uma posição por entrada
+    while (tableSize < entries) tableSize <<= 1;
+
+    s.entryCell.resize(entries);
+    s.entryHash.resize(entries);
+    parallelFor(nTriangles, SELF_COLLISION_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t t = begin; t < end; ++t) {
+            glm::ivec3 lo(glm::floor(s.boxMin[t] * invCellSize)), hi(glm::floor(s.boxMax[t] * invCellSize));
+            unsigned e = s.firstEntry[t];
+            for (int z = lo.z; z <= hi.z; ++z) {
+                for (int y = lo.y; y <= hi.y; ++y) {
+                    for (int x = lo.x; x <= hi.x; ++x, ++e) {
+                        s.entryCell[e] = glm::ivec3(x, y, z);
+                        s.entryHash[e] = hashCell(s.entryCell[e], tableSize);
+                    }
+                }
+            }
+        }
+    });
+
+    s.start.assign(tableSize + 1, 0);
+    for (unsigned h : s.entryHash) ++s.start[h];
+    unsigned sum = 0;
+    for (unsigned& first : s.start) {
+        unsigned n = first;
+        first = sum;
+        sum += n;
+    }
+    s.order.resize(entries);
+    s.sorted.resize(entries);
+    for (unsigned t = 0; t < nTriangles; ++t) {
+        for (unsigned e = s.firstEntry[t]; e < s.firstEntry[t + 1]; ++e) {
+            unsigned k = s.start[s.entryHash[e]]++;
+            s.order[k] = t;
+            s.sorted[k] = s.entryCell[e];
+        }
+    }
+    for (unsigned h = tableSize; h > 0; --h) s.start[h] = s.start[h - 1];
+    s.start[0] = 0;
+}
+
+// O lado da célula é 1,5 vez o tamanho médio das caixas, então um triângulo
+// comum ocupa poucas células e cada partícula só olha a sua. Um triângulo muito esticado
+// ocupa mais células sem deixar a busca das outras partículas mais cara.
+// Não há teste partícula-partícula: uma partícula que não é vizinha de outra
+// está pelo menos tão perto dos triângulos dela quanto dela mesma.
+// As correções só são aplicadas depois de todas calculadas, então o resultado
+// não depende da ordem nem do número de threads
+unsigned resolveSelfCollisions(Cloth& C, ClothSelfCollision& s) {
+    size_t n = C.positions.size();
+    size_t nTriangles = C.triangles.size();
+    if (n == 0 || nTriangles == 0 || s.thickness <= 0.0f) return 0;
+
+    const float thickness = s.thickness;
+    s.boxMin.resize(nTriangles);
+    s.boxMax.resize(nTriangles);
+    float extent = 0.0f;
+    for (size_t t = 0; t < nTriangles; ++t) {
+        const auto& tri = C.triangles[t];
+        const glm::vec3 &a = C.positions[tri[0]], &b = C.positions[tri[1]], &c = C.positions[tri[2]];
+        s.boxMin[t] = glm::min(a, glm::min(b, c)) - thickness;
+        s.boxMax[t] = glm::max(a, glm::max(b, c)) + thickness;
+        glm::vec3 size = s.boxMax[t] - s.boxMin[t];
+        extent += std::max(size.x, std::max(size.y, size.z));
+    }
+    const float invCellSize = nTriangles / (1.5f * extent);
+    buildTriangleGrid(s, invCellSize);
+
+    const unsigned tableSize = static_cast<unsigned>(s.start.size() - 1);
+    s.displacement.resize(n);
+    s.velocityChange.resize(n);
+
+    parallelFor(n, SELF_COLLISION_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const glm::vec3 p = C.positions[i];
+            const glm::vec3 v = C.velocities[i];
+            const glm::ivec3 cell(glm::floor(p * invCellSize));
+            glm::vec3 push(0.0f), dv(0.0f);
+            unsigned contacts = 0;
+
+            // Células diferentes podem cair na mesma posição, por isso a célula é conferida
+            unsigned h = hashCell(cell, tableSize);
+            for (unsigned k = s.start[h]; k < s.start[h + 1]; ++k) {
+                if (s.sorted[k] != cell) continue;
+                unsigned t = s.order[k];
+                const auto& tri = C.triangles[t];
+                if (tri[0] == i || tri[1] == i || tri[2] == i) continue;
+                const glm::vec3 &lo = s.boxMin[t], &hi = s.boxMax[t];
+                if (p.x < lo.x || p.y < lo.y || p.z < lo.z || p.x > hi.x || p.y > hi.y || p.z > hi.z) continue;
+
+                const glm::vec3& a = C.positions[tri[0]];
+                glm::vec3 e1 = C.positions[tri[1]] - a, e2 = C.positions[tri[2]] - a;
+                glm::vec3 d = p - closestPointOnTriangle(p, a, e1, e2);
+                float d2 = glm::dot(d, d);
+                if (d2 >= thickness * thickness) continue;
+
+                // Sobre o triângulo a direção vem da normal da face
+                float dist = std::sqrt(d2);
+                glm::vec3 normal;
+                if (dist > 1e-6f) {
+                    normal = d / dist;
+                } else {
+                    normal = glm::cross(e1, e2);
+                    float length = glm::length(normal);
+                    if (length == 0.0f) continue;
+                    normal /= length;
+                }
+
+                // Metade para cada lado: os vértices do triângulo recebem
+                // a outra metade pelos próprios contatos com o tecido da partícula
+                push += normal * (0.5f * (thickness - dist));
+                glm::vec3 vTri = (C.velocities[tri[0]] + C.velocities[tri[1]] + C.velocities[tri[2]]) / 3.0f;
+                float vn = glm::dot(v - vTri, normal);
+                if (vn < 0.0f) dv -= 0.5f * vn * normal;
+                ++contacts;
+            }
+
+            // Média dos contatos, para não passar do ponto quando há muitos
+            float weight = contacts > 0 ? 1.0f / contacts : 0.0f;
+            s.displacement[i] = push * weight;
+            s.velocityChange[i] = dv * weight;
+        }
+    });
+
+    unsigned corrected = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (s.displacement[i] == glm::vec3(0.0f) && s.velocityChange[i] == glm::vec3(0.0f)) continue;
+        C.positions[i] += s.displacement[i];
+        C.velocities[i] += s.velocityChange[i];
+        ++corrected;
+    }
+    return corrected;
+}
+
+// Partículas por tarefa do pool no kernel das molas: uma faixa cabe no cache
+// durante as passadas por coluna do ELL
+static constexpr size_t SPRING_GRAIN = 4096;
+
+void buildClothSoA(const Cloth& C, ClothSoA& soa) {
+    size_t n = C.positions.size();
+    std::vector<unsigned> degree(n, 0);
+    for (const auto& [i, j] : C.edges) {
+        ++degree[i];
+        ++degree[j];
+    }
+    soa.width = n > 0 ? *std::max_element(degree.begin(), degree.end()) : 0;
+    soa.springs = C.edges.size();
+
+    // Vizinhos de cada partícula em ordem crescente: partículas próximas no
+    // vetor leem vizinhos próximos na memória
+    std::vector<std::vector<std::pair<unsigned, float>>> lists(n);
+    for (size_t k = 0; k < C.edges.size(); ++k) {
+        auto [i, j] = C.edges[k];
+        lists[i].push_back({unsigned(j), C.restLengths[k]});
+        lists[j].push_back({unsigned(i), C.restLengths[k]});
+    }
+    soa.neighbor.resize(size_t(soa.width) * n);
+    soa.rest.resize(size_t(soa.width) * n);
+    for (size_t i = 0; i < n; ++i) {
+        std::sort(lists[i].begin(), lists[i].end());
+        for (unsigned k = 0; k < soa.width; ++k) {
+            bool spring = k < lists[i].size();
+            soa.neighbor[k * n + i] = spring ? lists[i][k].first : unsigned(i);
+            soa.rest[k * n + i] = spring ? lists[i][k].second : 0.0f;
+        }
+    }
+
+    for (auto* v : {&soa.x, &soa.y, &soa.z, &soa.vx, &soa.vy, &soa.vz, &soa.fx, &soa.fy, &soa.fz}) v->resize(n);
+}
+
+void loadClothSoA(const Cloth& C, ClothSoA& soa) {
+    parallelFor(soa.size(), SPRING_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            soa.x[i] = C.positions[i].x;
+            soa.y[i] = C.positions[i].y;
+            soa.z[i] = C.positions[i].z;
+            soa.vx[i] = C.velocities[i].x;
+            soa.vy[i] = C.velocities[i].y;
+            soa.vz[i] = C.velocities[i].z;
+        }
+    });
+}
+
+// Uma coluna do ELL para as partículas [begin, end): soma em f a mola que liga
+// cada partícula ao vizinho da coluna. Sem desvios: com d = 0 (sobras, em que o
+// vizinho é a própria partícula) a força sai 0 pela multiplicação por d
+static void springColumnKernel(const float* __restrict x, const float* __restrict y,
+                               const float* __restrict z,
+                               const float* __restrict vx, const float* __restrict vy,
+                               const float* __restrict vz,
+                               const unsigned* __restrict neighbor, const float* __restrict rest,
+                               float* __restrict fx, float* __restrict fy, float* __restrict fz,
+                               size_t begin, size_t end) {
+    const float ks = SPRING_STIFFNESS, kd = SPRING_DAMPING;
+    for (size_t i = begin; i < end; ++i) {
+        unsigned j = neighbor[i];
+        float dx = x[j] - x[i], dy = y[j] - y[i], dz = z[j] - z[i];
+        float len = std::sqrt(dx * dx + dy * dy + dz * dz);
+        float inv = 1.0f / std::max(len, 1e-12f);
+        float vn = ((vx[j] - vx[i]) * dx + (vy[j] - vy[i]) * dy + (vz[j] - vz[i]) * dz) * inv;
+        float s = (ks * (len - rest[i]) + kd * vn) * inv;
+        fx[i] += s * dx;
+        fy[i] += s * dy;
+        fz[i] += s * dz;
+    }
+}
+
+void computeSpringForces(ClothSoA& soa) {
+    const size_t n = soa.size();
+    parallelFor(n, SPRING_GRAIN, [&](size_t begin, size_t end) {
+        std::fill(soa.fx.begin() + begin, soa.fx.begin() + end, 0.0f);
+        std::fill(soa.fy.begin() + begin, soa.fy.begin() + end, 0.0f);
+        std::fill(soa.fz.begin() + begin, soa.fz.begin() + end, 0.0f);
+        for (unsigned k = 0; k < soa.width; ++k) {
+            springColumnKernel(soa.x.data(), soa.y.data(), soa.z.data(),
+                               soa.vx.data(), soa.vy.data(), soa.vz.data(),
+                               soa.neighbor.data() + k * n, soa.rest.data() + k * n,
+                               soa.fx.data(), soa.fy.data(), soa.fz.data(), begin, end);
+        }
+    });
+}
+
+// Integrador explícito com as molas no kernel SoA: copia o estado, calcula as
+// forças e integra de volta no tecido, tudo em faixas no pool
+static void integrateExplicit(Cloth& C, float dt, ClothSoA& soa) {
+    size_t n = C.positions.size();
+    if (soa.size() != n || soa.springs != C.edges.size()) buildClothSoA(C, soa);
+    loadClothSoA(C, soa);
+    computeSpringForces(soa);
+
+    const float invMass = 1.0f / C.mass;
+    parallelFor(n, SPRING_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            glm::vec3 a = glm::vec3(soa.fx[i], soa.fy[i], soa.fz[i]) * invMass + CLOTH_GRAVITY;
+            C.velocities[i] += a * dt;
+            C.positions[i] += C.velocities[i] * dt;
+        }
+    });
+}
+
+void integrateCloth(Cloth& C, float dt, ClothSolver& solver) {
+    switch (solver.integrator) {
+    case ClothIntegrator::Implicit:
+        integrateClothImplicit(C, dt, solver.implicit);
+        break;
+    case ClothIntegrator::XPBD:
+        integrateClothXPBD(C, dt, solver.xpbd);
+        break;
+    default:
+        integrateExplicit(C, dt, solver.soa);
+        break;
+    }
+}
+
+// Triângulos ou vértices por tarefa do pool no cálculo das normais
+static constexpr size_t NORMAL_GRAIN = 8192;
+
+void buildClothNormals(const Cloth& C, ClothNormals& N) {
+    size_t n = C.positions.size();
+    N.vertexStart.assign(n + 1, 0);
+    for (const auto& tri : C.triangles)
+        for (unsigned v : tri) ++N.vertexStart[v + 1];
+    for (size_t i = 0; i < n; ++i) N.vertexStart[i + 1] += N.vertexStart[i];
+
+    // Triângulos de cada vértice em ordem crescente, como em C.triangles
+    N.vertexTriangles.resize(N.vertexStart[n]);
+    std::vector<unsigned> next(N.vertexStart.begin(), N.vertexStart.end() - 1);
+    for (size_t t = 0; t < C.triangles.size(); ++t)
+        for (unsigned v : C.triangles[t]) N.vertexTriangles[next[v]++] = unsigned(t);
+
+    N.faceNormals.resize(C.triangles.size());
+    N.normals.resize(n);
+}
+
+void computeClothNormals(const Cloth& C, ClothNormals& N) {
+    if (N.size() != C.positions.size() || N.faceNormals.size() != C.triangles.size()) buildClothNormals(C, N);
+
+    // O produto vetorial sem normalizar já pesa cada face pela área
+    parallelFor(C.triangles.size(), NORMAL_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t t = begin; t < end; ++t) {
+            const auto& tri = C.triangles[t];
+            const glm::vec3& a = C.positions[tri[0]];
+            N.faceNormals[t] = glm::cross(C.positions[tri[1]] - a, C.positions[tri[2]] - a);
+        }
+    });
+
+    parallelFor(N.size(), NORMAL_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            glm::vec3 sum(0.0f);
+            for (unsigned k = N.vertexStart[i]; k < N.vertexStart[i + 1]; ++k) sum += N.faceNormals[N.vertexTriangles[k]];
+            // Vértice solto ou com triângulos degenerados: fica com a normal para cima
+            float length2 = glm::dot(sum, sum);
+            N.normals[i] = length2 > 0.0f ? sum / std::sqrt(length2) : glm::vec3(0.0f, 1.0f, 0.0f);
+        }
+    });
+}
@@ -1,9 +1,16 @@
 #include <glm/glm.hpp>
+#include <cmath>
 #include <iostream>
 #include <fstream>
 #include "hpp/raycast.hpp"
 #include <glm/glm.hpp>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 //intersecção raio triãngulo
 bool rayTriangleIntersect(const glm::vec3& orig, const glm::vec3& d,
                           const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2,
@@ -32,3 +39,204 @@ bool rayTriangleIntersect(const glm::vec3& orig, const glm::vec3& d,
     t = glm::dot(e2, qvec) * invDet;
     return t > EPSILON;
 }
+
+#if !defined(__AVX2__) && !defined(__SSE2__)
+// Möller-Trumbore com as arestas já calculadas, com as saídas antecipadas do caso escalar.
+// Usado pelas lanes quando não há SIMD
+static bool intersectEdges(const glm::vec3& orig, const glm::vec3& d,
+                           const glm::vec3& v0, const glm::vec3& e1, const glm::vec3& e2,
+                           float tMax, float& t, float& u, float& v) {
+    const float EPSILON = 1e-2f;
+    glm::vec3 p = glm::cross(d, e2);
+    float det = glm::dot(e1, p);
+    if (!(std::fabs(det) >= EPSILON)) return false;
+    float invDet = 1.0f / det;
+
+    glm::vec3 tvec = orig - v0;
+    u = glm::dot(tvec, p) * invDet;
+    if (!(u >= 0.0f && u <= 1.0f)) return false;
+
+    glm::vec3 qvec = glm::cross(tvec, e1);
+    v = glm::dot(d, qvec) * invDet;
+    if (!(v >= 0.0f && u + v <= 1.0f)) return false;
+
+    t = glm::dot(e2, qvec) * invDet;
+    return t > EPSILON && t < tMax;
+}
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+// Operações vetoriais usadas pelos kernels abaixo. Cada conjunto de instruções
+// implementa a mesma interface, assim o Möller-Trumbore é escrito uma única vez
+namespace simd {
+#if defined(__AVX2__)
+    using floatv = __m256;
+    using maskv = __m256;
+
+    inline floatv load(const float* p) { return _mm256_loadu_ps(p); }
+    inline void store(float* p, floatv a) { _mm256_storeu_ps(p, a); }
+    inline floatv set1(float a) { return _mm256_set1_ps(a); }
+    inline floatv add(floatv a, floatv b) { return _mm256_add_ps(a, b); }
+    inline floatv sub(floatv a, floatv b) { return _mm256_sub_ps(a, b); }
+    inline floatv mul(floatv a, floatv b) { return _mm256_mul_ps(a, b); }
+    inline floatv div(floatv a, floatv b) { return _mm256_div_ps(a, b); }
+    inline floatv abs(floatv a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+    inline maskv lt(floatv a, floatv b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    inline maskv le(floatv a, floatv b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    inline maskv both(maskv a, maskv b) { return _mm256_and_ps(a, b); }
+    inline unsigned bits(maskv m) { return static_cast<unsigned>(_mm256_movemask_ps(m)); }
+    inline floatv select(maskv m, floatv a, floatv b) { return _mm256_blendv_ps(b, a, m); }
+#elif defined(__SSE2__)
+    using floatv = __m128;
+    using maskv = __m128;
+
+    inline floatv load(const float* p) { return _mm_loadu_ps(p); }
+    inline void store(float* p, floatv a) { _mm_storeu_ps(p, a); }
+    inline floatv set1(float a) { return _mm_set1_ps(a); }
+    inline floatv add(floatv a, floatv b) { return _mm_add_ps(a, b); }
+    inline floatv sub(floatv a, floatv b) { return _mm_sub_ps(a, b); }
+    inline floatv mul(floatv a, floatv b) { return _mm_mul_ps(a, b); }
+    inline floatv div(floatv a, floatv b) { return _mm_div_ps(a, b); }
+    inline floatv abs(floatv a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+    inline maskv lt(floatv a, floatv b) { return _mm_cmplt_ps(a, b); }
+    inline maskv le(floatv a, floatv b) { return _mm_cmple_ps(a, b); }
+    inline maskv both(maskv a, maskv b) { return _mm_and_ps(a, b); }
+    inline unsigned bits(maskv m) { return static_cast<unsigned>(_mm_movemask_ps(m)); }
+    inline floatv select(maskv m, floatv a, floatv b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+#endif
+
+    // Möller-Trumbore em todas as lanes, com os mesmos testes de rayTriangleIntersect.
+    // Retorna a máscara das lanes atingidas com t < tMax
+    inline maskv intersect(floatv ox, floatv oy, floatv oz,
+                           floatv dx, floatv dy, floatv dz,
+                           floatv v0x, floatv v0y, floatv v0z,
+                           floatv e1x, floatv e1y, floatv e1z,
+                           floatv e2x, floatv e2y, floatv e2z,
+                           floatv tMax, floatv& t, floatv& u, floatv& v)
+    {
+        const floatv epsilon = set1(1e-2f);
+        const floatv zero = set1(0.0f);
+        const floatv one = set1(1.0f);
+
+        // p = d x e2, det = e1 . p
+        floatv px = sub(mul(dy, e2z), mul(dz, e2y));
+        floatv py = sub(mul(dz, e2x), mul(dx, e2z));
+        floatv pz = sub(mul(dx, e2y), mul(dy, e2x));
+        floatv det = add(add(mul(e1x, px), mul(e1y, py)), mul(e1z, pz));
+        maskv hit = le(epsilon, abs(det));
+        floatv invDet = div(one, det);
+
+        // u = (o - v0) . p / det
+        floatv tx = sub(ox, v0x), ty = sub(oy, v0y), tz = sub(oz, v0z);
+        u = mul(add(add(mul(tx, px), mul(ty, py)), mul(tz, pz)), invDet);
+        hit = both(hit, both(le(zero, u), le(u, one)));
+
+        // q = (o - v0) x e1, v = d . q / det
+        floatv qx = sub(mul(ty, e1z), mul(tz, e1y));
+        floatv qy = sub(mul(tz, e1x), mul(tx, e1z));
+        floatv qz = sub(mul(tx, e1y), mul(ty, e1x));
+        v = mul(add(add(mul(dx, qx), mul(dy, qy)), mul(dz, qz)), invDet);
+        hit = both(hit, both(le(zero, v), le(add(u, v), one)));
+
+        // t = e2 . q / det
+        t = mul(add(add(mul(e2x, qx), mul(e2y, qy)), mul(e2z, qz)), invDet);
+        return both(hit, both(lt(epsilon, t), lt(t, tMax)));
+    }
+}
+#endif
+
+void TriangleBlock::push(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, unsigned id) {
+    set(count, v0, v1, v2);
+    triangle[count] = id;
+    ++count;
+}
+
+void TriangleBlock::set(unsigned lane, const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2) {
+    glm::vec3 e1 = v1 - v0;
+    glm::vec3 e2 = v2 - v0;
+    v0x[lane] = v0.x; v0y[lane] = v0.y; v0z[lane] = v0.z;
+    e1x[lane] = e1.x; e1y[lane] = e1.y; e1z[lane] = e1.z;
+    e2x[lane] = e2.x; e2y[lane] = e2.y; e2z[lane] = e2.z;
+}
+
+void RayPacket::set(int lane, const glm::vec3& orig, const glm::vec3& d) {
+    ox[lane] = orig.x; oy[lane] = orig.y; oz[lane] = orig.z;
+    dx[lane] = d.x; dy[lane] = d.y; dz[lane] = d.z;
+}
+
+//um raio contra até SIMD_WIDTH triângulos
+int rayTriangleBlockIntersect(const glm::vec3& orig, const glm::vec3& d,
+                              const TriangleBlock& block, float tMax,
+                              float& t, float& u, float& v) {
+#if defined(__AVX2__) || defined(__SSE2__)
+    using namespace simd;
+    floatv tv, uv, vv;
+    unsigned mask = bits(intersect(set1(orig.x), set1(orig.y), set1(orig.z),
+                                   set1(d.x), set1(d.y), set1(d.z),
+                                   load(block.v0x), load(block.v0y), load(block.v0z),
+                                   load(block.e1x), load(block.e1y), load(block.e1z),
+                                   load(block.e2x), load(block.e2y), load(block.e2z),
+                                   set1(tMax), tv, uv, vv));
+    if (mask == 0) return -1;
+
+    float ts[SIMD_WIDTH], us[SIMD_WIDTH], vs[SIMD_WIDTH];
+    store(ts, tv); store(us, uv); store(vs, vv);
+
+    // Menor t entre as lanes atingidas; no empate vence a primeira, como no laço escalar
+    int closest = -1;
+    for (int lane = 0; lane < SIMD_WIDTH; ++lane) {
+        if ((mask >> lane & 1u) && (closest < 0 || ts[lane] < ts[closest])) closest = lane;
+    }
+    t = ts[closest]; u = us[closest]; v = vs[closest];
+    return closest;
+#else
+    int closest = -1;
+    for (unsigned lane = 0; lane < block.count; ++lane) {
+        glm::vec3 v0(block.v0x[lane], block.v0y[lane], block.v0z[lane]);
+        glm::vec3 e1(block.e1x[lane], block.e1y[lane], block.e1z[lane]);
+        glm::vec3 e2(block.e2x[lane], block.e2y[lane], block.e2z[lane]);
+        if (intersectEdges(orig, d, v0, e1, e2, tMax, t, u, v)) {
+            tMax = t;
+            closest = static_cast<int>(lane);
+        }
+    }
+    return closest;
+#endif
+}
+
+//SIMD_WIDTH raios contra um triângulo
+unsigned rayPacketTriangleIntersect(const RayPacket& rays,
+                                    const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2,
+                                    float t[SIMD_WIDTH], float u[SIMD_WIDTH], float v[SIMD_WIDTH]) {
+    glm::vec3 e1 = v1 - v0;
+    glm::vec3 e2 = v2 - v0;
+#if defined(__AVX2__) || defined(__SSE2__)
+    using namespace simd;
+
+    floatv tOld = load(t);
+    floatv tv, uv, vv;
+    maskv hit = intersect(load(rays.ox), load(rays.oy), load(rays.oz),
+                          load(rays.dx), load(rays.dy), load(rays.dz),
+                          set1(v0.x), set1(v0.y), set1(v0.z),
+                          set1(e1.x), set1(e1.y), set1(e1.z),
+                          set1(e2.x), set1(e2.y), set1(e2.z),
+                          tOld, tv, uv, vv);
+
+    store(t, select(hit, tv, tOld));
+    store(u, select(hit, uv, load(u)));
+    store(v, select(hit, vv, load(v)));
+    return bits(hit);
+#else
+    unsigned mask = 0;
+    for (int lane = 0; lane < SIMD_WIDTH; ++lane) {
+        glm::vec3 orig(rays.ox[lane], rays.oy[lane], rays.oz[lane]);
+        glm::vec3 d(rays.dx[lane], rays.dy[lane], rays.dz[lane]);
+        float tl, ul, vl;
+        if (intersectEdges(orig, d, v0, e1, e2, t[lane], tl, ul, vl)) {
+            t[lane] = tl; u[lane] = ul; v[lane] = vl;
+            mask |= 1u << lane;
+        }
+    }
+    return mask;
+#endif
+}
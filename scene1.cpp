@@ -20,6 +20,8 @@
 #include "physics.hpp"  // Deve conter PhysicalObject e update_ambient_forces()
 #include "hpp/obj_loader.hpp"
 #include "hpp/raycast.hpp" //implementação do raycast
+#include "hpp/thread_pool.hpp"
+#include "hpp/tile_renderer.hpp" //renderização paralela por tiles
 #include "hpp/materials.hpp" //predefinição de alguns materiais
 
 // -----------------------Variáveis da cena-----------------------------------------------------------------------------------------
@@ -110,7 +112,9 @@ void updatePhysics(PhysObj& obj1, double dt) {
     }
 }
 
-GLuint createVAO(const std::vector<glm::vec3>& vertices, const std::vector<glm::vec3>& normals) {
+// Com triangles, a VAO também guarda o buffer de índices para glDrawElements
+GLuint createVAO(const std::vector<glm::vec3>& vertices, const std::vector<glm::vec3>& normals,
+                 const std::vector<MeshData::triangle_t>& triangles = {}) {
     GLuint VAO, VBOs[2];
     glGenVertexArrays(1, &VAO);
     glGenBuffers(2, VBOs);
@@ -129,6 +133,14 @@ GLuint createVAO(const std::vector<glm::vec3>& vertices, const std::vector<glm::
     glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
     glEnableVertexAttribArray(1);
 
+    // Índices dos triângulos, enviados direto do vetor plano da malha
+    if (!triangles.empty()) {
+        GLuint EBO;
+        glGenBuffers(1, &EBO);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, triangles.size() * sizeof(triangles[0]), triangles.data(), GL_STATIC_DRAW);
+    }
+
     glBindVertexArray(0);
     return VAO;
 }
@@ -217,26 +229,33 @@ void main() {
 
 int main(int argc, char** argv) {
     //define o chão
-    ground.vertices = {
+    auto groundMesh = std::make_shared<MeshData>();
+    groundMesh->vertices = {
     { -10.0f, 0.0f, -10.0f },
     {  10.0f, 0.0f, -10.0f },
     {  10.0f, 0.0f,  10.0f },
     { -10.0f, 0.0f,  10.0f }
     };
-    ground.normals = {
+    groundMesh->normals = {
         { 0.0f, 1.0f, 0.0f }
     };
-    ground.faces = {
-        Face{ {0, 1, 2}, {0, 0, 0}, "" },  // Triângulo 1
-        Face{ {0, 2, 3}, {0, 0, 0}, "" }   // Triângulo 2
-    };
+    groundMesh->triangles = { {0, 1, 2}, {0, 2, 3} };
+    groundMesh->normalIndices = { {0, 0, 0}, {0, 0, 0} };
+    groundMesh->materialIds = { 0, 0 };
+    groundMesh->materialNames = { "" };
+    ground.mesh = groundMesh;
 
     //--------------------------------------------------------------------------
     if (argc < 2) {
-        std::cerr << "Uso: ./render modelo1.obj" << std::endl;
+        std::cerr << "Uso: ./render modelo1.obj [threads]" << std::endl;
         return -1;
     }
 
+    // Número de threads do raycast, 0 usa todos os núcleos
+    unsigned nThreads = (argc > 2) ? static_cast<unsigned>(std::stoi(argv[2])) : 0;
+    setThreadCount(nThreads);
+    std::cout << "Renderizando com " << globalThreadPool().size() << " threads" << std::endl;
+
     if (!glfwInit()) return -1;
 
     glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE); // janela invisível
@@ -265,11 +284,12 @@ int main(int argc, char** argv) {
     homer.mass = 1.0;
     homer.position = glm::dvec3(5.0, 5.0, 0.0);
     homer.velocity = glm::dvec3(0.0, -2.0, 0.0);
+    const MeshData& homerMesh = *homer.mesh;
 
 
     // Bounding box da malha
-    glm::vec3 mesh_min = homer.vertices[0], mesh_max = homer.vertices[0];
-    for (auto& v : homer.vertices) {
+    glm::vec3 mesh_min = homerMesh.vertices[0], mesh_max = homerMesh.vertices[0];
+    for (auto& v : homerMesh.vertices) {
         mesh_min = glm::min(mesh_min, v);
         mesh_max = glm::max(mesh_max, v);
     }
@@ -277,11 +297,17 @@ int main(int argc, char** argv) {
 
     PhysObj obj1 { glm::vec3(-3, 23, 0), 0.0f, bbox_local }; 
 
-    GLuint groundVAO = createVAO(ground.vertices, ground.normals);
+    // Árvore AABB da malha em espaço local, usada pelo raycast. O id de cada
+    // triângulo é a sua posição nos vetores planos da malha
+    AABBTree homerTree(Mesh(homerMesh.vertices, homerMesh.triangles), BuildStrategy::SAH);
+    homerTree.build();
+    std::cout << homerTree.quality() << std::endl;
+
+    GLuint groundVAO = createVAO(groundMesh->vertices, groundMesh->normals);
 
     // antes do loop, crie VAO e shaders uma vez:
 
-    GLuint VAO1 = createVAO(homer.vertices, homer.normals);
+    GLuint VAO1 = createVAO(homerMesh.vertices, homerMesh.normals, homerMesh.triangles);
 
     GLuint shaderProgram = glCreateProgram();
     GLuint vs = compileShader(GL_VERTEX_SHADER, vertex_shader_src);
@@ -326,7 +352,7 @@ int main(int argc, char** argv) {
         glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model1));
         glUniform3fv(ColorLoc, 1, glm::value_ptr(m.diffuse));
         glBindVertexArray(VAO1);
-        glDrawArrays(GL_TRIANGLES, 0, homer.vertices.size());
+        glDrawElements(GL_TRIANGLES, (GLsizei)(homerMesh.triangles.size() * 3), GL_UNSIGNED_INT, 0);
 
         // Captura frame e salva
         std::vector<unsigned char> pixels(800 * 600 * 3);
@@ -336,62 +362,54 @@ int main(int argc, char** argv) {
         glm::vec3 lightColor(1, 1, 1);
 
         std::vector<unsigned char> framebuffer(width * height * 3); // all pixel with null value
-        
-        for (int y = 0; y < height; ++y) {
-            for (int x = 0; x < width; ++x) {
-                float px = (2.0f * (x + 0.5f) / width - 1.0f) * imagePlaneWidth * 0.5f;
-                float py = (1.0f - 2.0f * (y + 0.5f) / height) * imagePlaneHeight * 0.5f;
-                glm::vec3 pixelPos = cameraPos + forward + px * right + py * camUp;
-                glm::vec3 dir = glm::normalize(pixelPos - cameraPos);
-
-                float closestT = 1e30f;
-                glm::vec3 hitPoint, hitNormal;
-                Material hitMat = gold;
-
-                for (const Face& f : homer.faces) {
-                    if (f.vertex_indices.size() < 3) continue;
-                    
-
-                    glm::vec3 v0 = homer.vertices[f.vertex_indices[0]];
-                    glm::vec3 v1 = homer.vertices[f.vertex_indices[1]];
-                    glm::vec3 v2 = homer.vertices[f.vertex_indices[2]];
-
-                    glm::mat4 model1 = glm::translate(glm::mat4(1.0f), glm::vec3(homer.position));
-                    glm::vec3 v0w = glm::vec3(model1 * glm::vec4(v0, 1.0f));
-                    glm::vec3 v1w = glm::vec3(model1 * glm::vec4(v1, 1.0f));
-                    glm::vec3 v2w = glm::vec3(model1 * glm::vec4(v2, 1.0f));
-                    float t, u, v;
-                    if (rayTriangleIntersect(cameraPos, dir, v0w, v1w, v2w, t, u, v)) {
-                        if (t < closestT) {
-                            closestT = t;
-                            hitPoint = cameraPos + dir * t;
-                            glm::vec3 n0 = homer.normals[f.normal_indices[0]];
-                            glm::vec3 n1 = homer.normals[f.normal_indices[1]];
-                            glm::vec3 n2 = homer.normals[f.normal_indices[2]];
-                            hitNormal = glm::normalize((1 - u - v) * n0 + u * n1 + v * n2);
-                            if (homer.materials.count(f.material_name))
-                                hitMat = homer.materials[f.material_name];
-                        }
-                    }
-                }
 
-                glm::vec3 color = (closestT < 1e30f)
-                                ? computeColor(hitPoint, hitNormal, lightPos, lightColor, hitMat)
-                                : glm::vec3(0.0f, 0.7f, 1.0f);
+        // O homer só é transladado, então o raio é levado para o espaço local da malha
+        // uma vez por frame, em vez de transformar os triângulos
+        glm::vec3 localOrigin = cameraPos - glm::vec3(homer.position);
+
+        // Cada tile escreve só os seus pixels, a imagem é a mesma com qualquer número de threads
+        renderTiles(width, height, DEFAULT_TILE_SIZE, [&](const Tile& tile) {
+            for (int y = tile.y0; y < tile.y1; ++y) {
+                for (int x = tile.x0; x < tile.x1; ++x) {
+                    float px = (2.0f * (x + 0.5f) / width - 1.0f) * imagePlaneWidth * 0.5f;
+                    float py = (1.0f - 2.0f * (y + 0.5f) / height) * imagePlaneHeight * 0.5f;
+                    glm::vec3 pixelPos = cameraPos + forward + px * right + py * camUp;
+                    glm::vec3 dir = glm::normalize(pixelPos - cameraPos);
+
+                    float closestT = 1e30f;
+                    glm::vec3 hitPoint, hitNormal;
+                    Material hitMat = gold;
+
+                    RayHit hit;
+                    if (homerTree.intersect(localOrigin, dir, hit)) {
+                        const MeshData::triangle_t& ni = homerMesh.normalIndices[hit.face];
+                        closestT = hit.t;
+                        hitPoint = cameraPos + dir * hit.t;
+                        glm::vec3 n0 = homerMesh.normals[ni[0]];
+                        glm::vec3 n1 = homerMesh.normals[ni[1]];
+                        glm::vec3 n2 = homerMesh.normals[ni[2]];
+                        hitNormal = glm::normalize((1 - hit.u - hit.v) * n0 + hit.u * n1 + hit.v * n2);
+                        if (const Material* mat = homerMesh.material(hit.face)) // find não altera o mapa entre threads
+                            hitMat = *mat;
+                    }
 
-                //color = glm::clamp(color, 0.0f, 1.0f);
-                int idx = 3 * (y * width + x);
-                framebuffer[idx + 0] = static_cast<unsigned char>(glm::clamp(color.r, 0.0f, 1.0f) * 255.0f); // R
-                framebuffer[idx + 1] = static_cast<unsigned char>(glm::clamp(color.g, 0.0f, 1.0f) * 255.0f); // G
-                framebuffer[idx + 2] = static_cast<unsigned char>(glm::clamp(color.b, 0.0f, 1.0f) * 255.0f); // B
+                    glm::vec3 color = (closestT < 1e30f)
+                                    ? computeColor(hitPoint, hitNormal, lightPos, lightColor, hitMat)
+                                    : glm::vec3(0.0f, 0.7f, 1.0f);
 
+                    //color = glm::clamp(color, 0.0f, 1.0f);
+                    int idx = 3 * (y * width + x);
+                    framebuffer[idx + 0] = static_cast<unsigned char>(glm::clamp(color.r, 0.0f, 1.0f) * 255.0f); // R
+                    framebuffer[idx + 1] = static_cast<unsigned char>(glm::clamp(color.g, 0.0f, 1.0f) * 255.0f); // G
+                    framebuffer[idx + 2] = static_cast<unsigned char>(glm::clamp(color.b, 0.0f, 1.0f) * 255.0f); // B
+                }
             }
-        }
+        });
 
         std::ostringstream oss;
         oss << "./frame/scene1/frame" << std::setw(3) << std::setfill('0') << frame << ".png";
 
-        stbi_write_png(oss.str().c_str(), width, width, 3, framebuffer.data(), width * 3);
+        stbi_write_png(oss.str().c_str(), width, height, 3, framebuffer.data(), width * 3);
         std::cout << "Imagem salva em " << oss.str() << std::endl;
     }
 
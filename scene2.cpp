@@ -15,11 +15,63 @@
 #include <iomanip>
 #include <algorithm>
 #include <filesystem> // Para criar diretórios
+#include <atomic>
+#include <cstdlib>
+#include <new>
 
 #include "AABB.hpp"
 #include "physics.hpp"  
 #include "hpp/obj_loader.hpp"
 #include "hpp/materials.hpp"
+#include "hpp/thread_pool.hpp"
+
+// Contador de alocações: o operator new global deste executável conta cada
+// chamada, para conferir que o passo da simulação não aloca depois dos primeiros quadros.
+// As formas alinhadas também são substituídas, porque os vetores de LinearNode e
+// TriangleBlock (alignas(32)) que a árvore do tecido usa passam por elas; as
+// formas de array e nothrow repassam para as duas primeiras
+static std::atomic<size_t> alocacoes{0};
+
+void* operator new(std::size_t size) {
+    alocacoes.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new(std::size_t size, std::align_val_t al) {
+    alocacoes.fetch_add(1, std::memory_order_relaxed);
+    // aligned_alloc exige tamanho múltiplo do alinhamento
+    std::size_t alinhamento = static_cast<std::size_t>(al);
+    std::size_t tamanho = (size + alinhamento - 1) / alinhamento * alinhamento;
+    if (void* p = std::aligned_alloc(alinhamento, tamanho ? tamanho : alinhamento)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t size) { return operator new(size); }
+void* operator new[](std::size_t size, std::align_val_t al) { return operator new(size, al); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    try { return operator new(size); } catch (...) { return nullptr; }
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    try { return operator new(size); } catch (...) { return nullptr; }
+}
+void* operator new(std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept {
+    try { return operator new(size, al); } catch (...) { return nullptr; }
+}
+void* operator new[](std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept {
+    try { return operator new(size, al); } catch (...) { return nullptr; }
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { std::free(p); }
 
 // Shaders
 const char* vertexShaderSource = R"(
@@ -62,6 +114,7 @@ void main()
 
     // Diffuse
     vec3 norm = normalize(Normal);
+    if (dot(norm, viewPos - FragPos) < 0.0) norm = -norm; // O tecido é visto dos dois lados
     vec3 lightDir = normalize(lightPos - FragPos);
     float diff = max(dot(norm, lightDir), 0.0);
     vec3 diffuse = diff * lightColor;
@@ -157,48 +210,43 @@ std::vector<glm::vec3> groundVerts = {
 };
 std::vector<glm::vec3> groundNormals(groundVerts.size(), glm::vec3(0.0f,1.0f,0.0f));
 
-// Lida com as colisões com a caixa e com o chão
-void resolveCollisions(Cloth& C, const AABB& box, float floorY=0.0f, float restitution=0.3f, int iterations=3) {
+// Lida com as colisões com a malha do objeto e com o chão. Cada partícula
+// busca o ponto mais próximo da malha na árvore AABB; como as partículas são
+// independentes, rodam em paralelo
+void resolveCollisions(Cloth& C, const AABBTree& meshTree, const glm::vec3& meshOffset,
+                       float floorY=0.0f, float restitution=0.3f, float thickness=0.02f) {
     const float epsilon = 1e-3f;
-    const float penThreshold = 0.5f;
     const float frictionCoeff = 0.9f;
-    
-    for (int iter = 0; iter < iterations; ++iter) {
-        for (int i = 0; i < (int)C.positions.size(); ++i) {
 
+    parallelFor(C.positions.size(), 1024, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
             auto& p = C.positions[i];
             auto& v = C.velocities[i];
-            
-            // Calcula o quanto passou a bounding box da caixa pra cada direção
-            if (box.contains(p)) {
-                float dtc[6] = {
-                    box.max_corner.y - p.y, // Topo
-                    p.y - box.min_corner.y,  // Base
-                    p.x - box.min_corner.x, // Esquerda
-                    box.max_corner.x - p.x, // Direita
-                    p.z - box.min_corner.z, // Frente
-                    box.max_corner.z - p.z // Trás
-                };
-
-                // Verifica se está dentro da caixa
-                int face = std::min_element(dtc, dtc+6) - dtc;
-                
-                // Para cada face, verifica se a distância é menor que o limiar de penetração. Se for menor, corrige a posição
-                if (dtc[face] < penThreshold) {
-                    switch(face) {
-                        case 0: p.y = box.max_corner.y + epsilon; v.y *= -restitution; break;
-                        case 1: p.y = box.min_corner.y - epsilon; v.y *= -restitution; break;
-                        case 2: p.x = box.min_corner.x + epsilon; v.x *= -restitution; break;
-                        case 3: p.x = box.max_corner.x + epsilon; v.x *= -restitution; break;
-                        case 4: p.z = box.min_corner.z + epsilon; v.z *= -restitution; break;
-                    }
-                    
-                    // Reduz a velocidade
-                    v.x *= frictionCoeff;
-                    v.z *= frictionCoeff;
+
+            // Busca até o dobro da espessura, assim uma partícula que entrou um
+            // pouco no objeto ainda é achada
+            ClosestHit hit;
+            glm::vec3 local = p - meshOffset;
+            if (meshTree.closestPoint(local, 2.0f * thickness, hit)) {
+                glm::vec3 delta = local - hit.point;
+                bool dentro = glm::dot(delta, hit.normal) < 0.0f; // Atrás da face
+
+                if (dentro || hit.distance < thickness) {
+                    // Dentro sai pela normal da face; fora, pela direção do ponto mais
+                    // próximo, que também serve perto de arestas e vértices
+                    glm::vec3 normal = hit.normal;
+                    if (!dentro && hit.distance > 1e-6f) normal = delta / hit.distance;
+                    p = meshOffset + hit.point + normal * thickness;
+
+                    float vn = glm::dot(v, normal);
+                    if (vn < 0.0f) v -= (1.0f + restitution) * vn * normal;
+
+                    // Atrito reduz só a parte tangente à superfície
+                    glm::vec3 vt = v - glm::dot(v, normal) * normal;
+                    v -= vt * (1.0f - frictionCoeff);
                 }
             }
-            
+
             // Verifica colisão com o chão
             if (p.y < floorY + epsilon) {
                 p.y = floorY + epsilon;
@@ -207,7 +255,7 @@ void resolveCollisions(Cloth& C, const AABB& box, float floorY=0.0f, float resti
                 v.z *= frictionCoeff;
             }
         }
-    }
+    });
 }
 
 // Acha os pontos mais próximos entre duas arestas
@@ -247,79 +295,96 @@ bool closestPointsBetweenEdges(
     return true;
 }
 
-// Resolve colisões de arestas
-void resolveEdgeCollisions(Cloth& C, const AABB& box, float restitution=0.3f, float thickness=0.1f) {
-    
-
-    std::vector<std::pair<glm::vec3, glm::vec3>> boxEdges = {
-        // Arestas da base
-        {box.min_corner, glm::vec3(box.max_corner.x, box.min_corner.y, box.min_corner.z)},
-        {box.min_corner, glm::vec3(box.min_corner.x, box.min_corner.y, box.max_corner.z)},
-        {glm::vec3(box.max_corner.x, box.min_corner.y, box.min_corner.z), 
-         glm::vec3(box.max_corner.x, box.min_corner.y, box.max_corner.z)},
-        {glm::vec3(box.min_corner.x, box.min_corner.y, box.max_corner.z), 
-         glm::vec3(box.max_corner.x, box.min_corner.y, box.max_corner.z)},
-        
-        //Verticais
-        {box.min_corner, glm::vec3(box.min_corner.x, box.max_corner.y, box.min_corner.z)},
-        {glm::vec3(box.max_corner.x, box.min_corner.y, box.min_corner.z), 
-         glm::vec3(box.max_corner.x, box.max_corner.y, box.min_corner.z)},
-        {glm::vec3(box.min_corner.x, box.min_corner.y, box.max_corner.z), 
-         glm::vec3(box.min_corner.x, box.max_corner.y, box.max_corner.z)},
-        {glm::vec3(box.max_corner.x, box.min_corner.y, box.max_corner.z), 
-         glm::vec3(box.max_corner.x, box.max_corner.y, box.max_corner.z)},
-        
-        // Superiores
-        {glm::vec3(box.min_corner.x, box.max_corner.y, box.min_corner.z), box.max_corner},
-        {glm::vec3(box.min_corner.x, box.max_corner.y, box.min_corner.z), 
-         glm::vec3(box.min_corner.x, box.max_corner.y, box.max_corner.z)},
-        {glm::vec3(box.max_corner.x, box.max_corner.y, box.min_corner.z), box.max_corner},
-        {glm::vec3(box.min_corner.x, box.max_corner.y, box.max_corner.z), box.max_corner}
-    };
-    
+// Resolve as arestas do tecido que passam perto das arestas da malha, caso em
+// que as partículas podem estar longe da superfície. clothTree é a árvore dos
+// triângulos do tecido nas posições atuais: só as arestas perto do objeto são
+// testadas. As correções são calculadas em paralelo e aplicadas depois, na
+// ordem das arestas, então o resultado não depende do número de threads.
+// Os vetores temporários ficam em solver, para não alocar a cada chamada
+void resolveEdgeCollisions(Cloth& C, const AABBTree& clothTree,
+                           const AABBTree& meshTree, const glm::vec3& meshOffset,
+                           ClothSolver& solver,
+                           float restitution=0.3f, float thickness=0.02f) {
     const float collisionEps = thickness * 1.1f;
-    
-    // Para cada aresta no tecido, verifica se colide com as arestas da caixa e resolve se necessário
-    for (const auto& clothEdge : C.edges) {
-        const glm::vec3& p1 = C.positions[clothEdge.first];
-        const glm::vec3& p2 = C.positions[clothEdge.second];
-        
-        for (const auto& boxEdge : boxEdges) {
-            glm::vec3 c1, c2;
-            // Verifica os pontos mais próximos entre a aresta do tecido e a aresta da caixa
-            if (closestPointsBetweenEdges(p1, p2, boxEdge.first, boxEdge.second, c1, c2)) {
-                glm::vec3 delta = c1 - c2;
-                float dist = glm::length(delta);
-                
-                // Verifica se a distância entre os pontos mais próximos for menor que o epsilon de colisão
-                if (dist < collisionEps) {
-                    glm::vec3 normal = glm::normalize(delta);
-                    float pen = collisionEps - dist;
-                    
-                    // Corrige a posição dos nós do tecido
-                    glm::vec3 hc = normal * (pen * 0.5f);
-                    C.positions[clothEdge.first]  += hc;
-                    C.positions[clothEdge.second] -= hc;
-
-                    // Corrige a velocidade
-                    glm::vec3 relVel = C.velocities[clothEdge.second] - C.velocities[clothEdge.first];
-                    float velNormal = glm::dot(relVel, normal);
-                    if (velNormal < 0.0f) {
-                 
-                        float j_total = -(1.0f + restitution) * velNormal;
-
-                        float j_half = j_total * 0.5f;
-                        glm::vec3 impulso = j_half * normal;
-                        C.velocities[clothEdge.first]  -= impulso;
-                        C.velocities[clothEdge.second] += impulso;
+    glm::vec3 margem(collisionEps);
+
+    // Uma aresta a menos de collisionEps do objeto está num triângulo cuja caixa
+    // toca a caixa aumentada do objeto, então os dois vértices dela são marcados aqui
+    AABB caixaMalha = meshTree.bounds();
+    std::vector<unsigned>& triangulosPerto = solver.nearTriangles;
+    triangulosPerto.clear();
+    clothTree.query(AABB(caixaMalha.min_corner + meshOffset - margem,
+                         caixaMalha.max_corner + meshOffset + margem), triangulosPerto);
+    if (triangulosPerto.empty()) return;
+    std::vector<char>& perto = solver.nearParticles;
+    perto.assign(C.positions.size(), 0);
+    for (unsigned t : triangulosPerto) {
+        for (unsigned v : C.triangles[t]) perto[v] = 1;
+    }
+    std::vector<unsigned>& arestas = solver.nearEdges;
+    arestas.clear();
+    for (unsigned k = 0; k < C.edges.size(); ++k) {
+        if (perto[C.edges[k].first] && perto[C.edges[k].second]) arestas.push_back(k);
+    }
+
+    // Direção (da malha para o tecido) e profundidade do contato mais fundo de cada aresta
+    std::vector<glm::vec3>& normais = solver.edgeNormal;
+    std::vector<float>& penetracoes = solver.edgeDepth;
+    normais.assign(arestas.size(), glm::vec3(0.0f));
+    penetracoes.assign(arestas.size(), 0.0f);
+
+    const size_t grao = 256;
+    size_t faixas = (arestas.size() + grao - 1) / grao;
+    if (solver.candidates.size() < faixas) solver.candidates.resize(faixas);
+
+    parallelFor(arestas.size(), grao, [&](size_t begin, size_t end) {
+        std::vector<unsigned>& candidatos = solver.candidates[begin / grao];
+        for (size_t a = begin; a < end; ++a) {
+            const auto& clothEdge = C.edges[arestas[a]];
+            glm::vec3 p1 = C.positions[clothEdge.first] - meshOffset;
+            glm::vec3 p2 = C.positions[clothEdge.second] - meshOffset;
+
+            // Triângulos da malha perto da aresta (os ids são os índices em mesh.triangles)
+            candidatos.clear();
+            meshTree.query(AABB(glm::min(p1, p2) - margem, glm::max(p1, p2) + margem), candidatos);
+
+            for (unsigned t : candidatos) {
+                const auto& tri = meshTree.mesh.triangles[t];
+                for (int k = 0; k < 3; ++k) {
+                    const glm::vec3& q1 = meshTree.mesh.coordinates[tri[k]];
+                    const glm::vec3& q2 = meshTree.mesh.coordinates[tri[(k + 1) % 3]];
+                    glm::vec3 c1, c2;
+                    // Verifica os pontos mais próximos entre a aresta do tecido e a aresta da malha
+                    if (!closestPointsBetweenEdges(p1, p2, q1, q2, c1, c2)) continue;
+
+                    glm::vec3 delta = c1 - c2;
+                    float dist = glm::length(delta);
+                    if (dist > 1e-6f && collisionEps - dist > penetracoes[a]) {
+                        normais[a] = delta / dist;
+                        penetracoes[a] = collisionEps - dist;
                     }
                 }
             }
         }
+    });
+
+    for (size_t a = 0; a < arestas.size(); ++a) {
+        if (penetracoes[a] <= 0.0f) continue;
+
+        // Afasta a aresta inteira da malha e tira a velocidade que entra nela
+        const auto& clothEdge = C.edges[arestas[a]];
+        const glm::vec3& normal = normais[a];
+        for (int v : {clothEdge.first, clothEdge.second}) {
+            C.positions[v] += normal * penetracoes[a];
+            float vn = glm::dot(C.velocities[v], normal);
+            if (vn < 0.0f) C.velocities[v] -= (1.0f + restitution) * vn * normal;
+        }
     }
 }
 
-GLuint createVAO(const std::vector<glm::vec3>& verts, const std::vector<glm::vec3>& norms) {
+// Com tris, a VAO também guarda o buffer de índices para glDrawElements
+GLuint createVAO(const std::vector<glm::vec3>& verts, const std::vector<glm::vec3>& norms,
+                 const std::vector<MeshData::triangle_t>& tris = {}) {
     GLuint VAO, VBO[2];
     glGenVertexArrays(1, &VAO);
     glGenBuffers(2, VBO);
@@ -332,6 +397,12 @@ GLuint createVAO(const std::vector<glm::vec3>& verts, const std::vector<glm::vec
     glBufferData(GL_ARRAY_BUFFER, norms.size()*sizeof(glm::vec3), norms.data(), GL_STATIC_DRAW);
     glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
     glEnableVertexAttribArray(1);
+    if (!tris.empty()) {
+        GLuint EBO;
+        glGenBuffers(1, &EBO);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, tris.size()*sizeof(tris[0]), tris.data(), GL_STATIC_DRAW);
+    }
     glBindVertexArray(0);
     return VAO;
 }
@@ -343,12 +414,24 @@ GLint lightPosLoc, lightColorLoc, viewPosLoc; // Adicionadas as localizações p
 
 int main(int argc, char** argv) {
     if (argc < 3) {
-        std::cerr << "Uso: " << argv[0] << " box.obj nFaces\n";
+        std::cerr << "Uso: " << argv[0] << " box.obj nFaces [threads] [explicito|implicito|xpbd]\n";
         return -1;
     }
 
     std::string objFIle   = argv[1];
     int nFaces        = std::atoi(argv[2]); // Quantidade da faces no tcido
+    if (argc > 3) setThreadCount(std::atoi(argv[3])); // 0 usa todos os núcleos
+
+    // Integrador do tecido: explícito (padrão), que precisa de subpassos, ou
+    // implícito e XPBD, estáveis com o passo inteiro
+    std::string integrador = (argc > 4) ? argv[4] : "explicito";
+    if (integrador != "explicito" && integrador != "implicito" && integrador != "xpbd") {
+        std::cerr << "Integrador inválido: " << integrador << "\n";
+        return -1;
+    }
+    ClothSolver solver; // Integrador e todos os vetores temporários da simulação do tecido
+    if (integrador == "implicito") solver.integrator = ClothIntegrator::Implicit;
+    if (integrador == "xpbd") solver.integrator = ClothIntegrator::XPBD;
 
     glfwInit();
     glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
@@ -376,26 +459,30 @@ int main(int argc, char** argv) {
 
     // carrega objeto
     loadOBJ(objFIle.c_str(), &box);
-    glm::vec3 bmin = box.vertices[0], bmax = bmin;
-    for (auto& v : box.vertices) {
-        bmin = glm::min(bmin, v);
-        bmax = glm::max(bmax, v);
-    }
-    AABB boxAABB(bmin, bmax);
+    const MeshData& boxMesh = *box.mesh;
+
+    // Árvore AABB da malha do objeto, em espaço local. O tecido colide com os
+    // triângulos dela, não com a caixa em volta do objeto
+    AABBTree boxTree(Mesh(boxMesh.vertices, boxMesh.triangles), BuildStrategy::SAH);
+    boxTree.build();
+    const float espessura = 0.02f; // Distância mínima entre o tecido e a malha
+    solver.selfCollision.thickness = espessura;
 
     // Cria VAOs
     GLuint groundVAO = createVAO(groundVerts, groundNormals);
-    GLuint boxVAO    = createVAO(box.vertices, box.normals);
+    GLuint boxVAO    = createVAO(boxMesh.vertices, boxMesh.normals, boxMesh.triangles);
 
     // Cria tecido
     createCloth(cloth, nFaces, 0.05f, 3.0f);
     cloth.mass = 0.5f;
+
+    // Árvore AABB do tecido: construída uma vez e reajustada (refit) a cada
+    // subpasso, sendo refeita só nas partes em que a qualidade caiu
+    AABBTree clothTree(Mesh(cloth.positions, cloth.triangles), BuildStrategy::SAH);
+    clothTree.build();
     
     // VAO/VBO do tecido
     GLuint clothVAO, clothPosVBO, clothNormalVBO, clothEBO;
-    std::vector<GLuint> edgeIdx;
-    edgeIdx.reserve(cloth.edges.size()*2);
-    for (auto&e: cloth.edges){ edgeIdx.push_back(e.first); edgeIdx.push_back(e.second);}   
     
     glGenVertexArrays(1, &clothVAO);
     glBindVertexArray(clothVAO);
@@ -406,16 +493,20 @@ int main(int argc, char** argv) {
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
     glEnableVertexAttribArray(0);
 
-    std::vector<glm::vec3> clothNormals(cloth.positions.size(), glm::vec3(0.0f, 1.0f, 0.0f)); // Normais iniciais
+    ClothNormals clothNormals; // Normais por vértice, recalculadas a cada quadro
+    computeClothNormals(cloth, clothNormals);
     glGenBuffers(1, &clothNormalVBO);
     glBindBuffer(GL_ARRAY_BUFFER, clothNormalVBO);
-    glBufferData(GL_ARRAY_BUFFER, clothNormals.size()*sizeof(glm::vec3), clothNormals.data(), GL_DYNAMIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, clothNormals.size()*sizeof(glm::vec3), clothNormals.normals.data(), GL_DYNAMIC_DRAW);
     glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
     glEnableVertexAttribArray(1);
 
     glGenBuffers(1, &clothEBO);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, clothEBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, edgeIdx.size()*sizeof(GLuint), edgeIdx.data(), GL_STATIC_DRAW);
+    // Os triângulos do tecido já são os índices do desenho
+    static_assert(sizeof(cloth.triangles[0]) == 3 * sizeof(GLuint), "triângulo do tecido deve ter 3 GLuint");
+    GLsizei clothIndexCount = (GLsizei)(cloth.triangles.size() * 3);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, clothIndexCount*sizeof(GLuint), cloth.triangles.data(), GL_STATIC_DRAW);
     glBindVertexArray(0);
 
 
@@ -428,6 +519,8 @@ int main(int argc, char** argv) {
 
 
 
+    std::vector<unsigned char> pixels(width*height*3); // Frame lido da GPU, reaproveitado
+
 // produção da cena
 for (int frame = 0; frame < 100; ++frame) {
     
@@ -449,41 +542,44 @@ for (int frame = 0; frame < 100; ++frame) {
     glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(M_box));
     glUniform3fv(objectColorLoc, 1, glm::value_ptr(boxMaterial.diffuse));
     glBindVertexArray(boxVAO);
-    glDrawArrays(GL_TRIANGLES, 0, (GLsizei)box.vertices.size());
+    glDrawElements(GL_TRIANGLES, (GLsizei)(boxMesh.triangles.size() * 3), GL_UNSIGNED_INT, 0);
 
     // Simula o tecido
-    int substeps = 3; //
+    int substeps = (solver.integrator == ClothIntegrator::Explicit) ? 3 : 1;
     float substepDt = dt / substeps;
+    size_t alocacoesAntes = alocacoes.load(std::memory_order_relaxed);
+    unsigned reconstrucoes = 0; // Subárvores do tecido refeitas; só elas alocam depois do aquecimento
 
     for (int i = 0; i < substeps; ++i) {
-        integrateCloth(cloth, substepDt); // Calcula o movimento do tecido
-        resolveCollisions(cloth, boxAABB, 0.0f, 0.2f, 3); // Cuida das colisões com o chão e com a caixa
-        resolveEdgeCollisions(cloth, boxAABB, 0.3f, 0.1f); // Cuida dos casos em que as arestas cortam a caixa
+        integrateCloth(cloth, substepDt, solver); // Calcula o movimento do tecido
+        resolveCollisions(cloth, boxTree, glm::vec3(box.position), 0.0f, 0.2f, espessura); // Cuida das colisões com o chão e com a malha
+        resolveSelfCollisions(cloth, solver.selfCollision); // Impede que o tecido atravesse a si mesmo
+        reconstrucoes += clothTree.update(cloth.positions);
+        resolveEdgeCollisions(cloth, clothTree, boxTree, glm::vec3(box.position), solver, 0.3f, espessura); // Cuida dos casos em que as arestas cortam a malha
     }
+    size_t alocacoesPasso = alocacoes.load(std::memory_order_relaxed) - alocacoesAntes;
 
     // Atualiza o tecido
     glBindBuffer(GL_ARRAY_BUFFER, clothPosVBO);
     glBufferSubData(GL_ARRAY_BUFFER, 0, cloth.positions.size()*sizeof(glm::vec3), cloth.positions.data());
 
-    std::vector<glm::vec3> clothNormalsUpdated(cloth.positions.size(), glm::vec3(0.0f, 1.0f, 0.0f));
+    computeClothNormals(cloth, clothNormals);
     glBindBuffer(GL_ARRAY_BUFFER, clothNormalVBO);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, clothNormalsUpdated.size()*sizeof(glm::vec3), clothNormalsUpdated.data());
+    glBufferSubData(GL_ARRAY_BUFFER, 0, clothNormals.size()*sizeof(glm::vec3), clothNormals.normals.data());
 
     // Cria o tecido
     glm::mat4 M_cloth = glm::mat4(1.0f);
     glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(M_cloth));
     glUniform3f(objectColorLoc, 0.7f, 0.2f, 0.2f);
     glBindVertexArray(clothVAO);
-    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-    glDrawElements(GL_LINES, (GLsizei)edgeIdx.size(), GL_UNSIGNED_INT, 0);
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    glDrawElements(GL_TRIANGLES, clothIndexCount, GL_UNSIGNED_INT, 0);
 
     // Frame atual
-    std::vector<unsigned char> pixels(width*height*3);
     glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
     std::ostringstream oss;
     oss << "./frame/scene2/frame" << std::setw(3) << std::setfill('0') << frame << ".png";
-    std::cout << "Saving frame: " << oss.str() << std::endl;
+    std::cout << "Saving frame: " << oss.str() << " (alocações na simulação: " << alocacoesPasso
+              << ", subárvores refeitas: " << reconstrucoes << ")" << std::endl;
     stbi_write_png(oss.str().c_str(), width, height, 3, pixels.data(), width*3);
 }
 
@@ -18,9 +18,13 @@
 #include <random>
 
 #include "AABB.hpp"
+#include "hpp/broadphase.hpp" //fase larga da colisão (sweep-and-prune e grade hash)
+#include "hpp/narrowphase.hpp" //fase estreita: árvore contra árvore e triângulo contra triângulo
 #include "physics.hpp"  // Deve conter PhysicalObject e update_ambient_forces()
 #include "hpp/obj_loader.hpp"
 #include "hpp/raycast.hpp" //implementação do raycast
+#include "hpp/thread_pool.hpp"
+#include "hpp/tile_renderer.hpp" //renderização paralela por tiles
 #include "hpp/materials.hpp" //predefinição de alguns materiais
 
 PhysicalObject homer;
@@ -73,60 +77,24 @@ std::vector<glm::vec3> groundVerts = {
     };
 std::vector<glm::vec3> groundNormals(groundVerts.size(), glm::vec3(0.0f, 1.0f, 0.0f));
 //---------------------------------------------------------------------------------------------------------------------------------
-struct PhysObj {
-    glm::vec3 position;
-    float     vy;
-    AABB      bbox;      // bounding box em espaço local
-};
-
-void updatePhysics(PhysObj& obj1, double dt, PhysicalObject *homer) {
-    std::cout << "Homer before: ("
-            << homer->position.x << ", "
-            << homer->position.y << ", "
-            << homer->position.z << ")\n";
-    applyTornadoForce(homer, origin, dt);
-    homer->position += homer->velocity * dt;
-    // Atualiza a posição do PhysObj com a posição do homer (sincroniza)
-    obj1.position = homer->position;
-    obj1.vy = static_cast<float>(homer->velocity.y);
+// Integra a posição do corpo i (o tornado já foi aplicado a todos em lote)
+// e trata a colisão da caixa local bbox com o chão (y=0)
+void updatePhysics(RigidBodySoA& corpos, size_t i, const AABB& bbox, double dt) {
+    glm::dvec3 position = corpos.position(i) + corpos.velocity(i) * dt;
     //PERGUNTA: Aparentemente nao esta mais acelerando com a gravidade
 
-    // Translada a AABB para o espaço de mundo
-    AABB world_box = obj1.bbox;
-    world_box.min_corner += obj1.position;
-    world_box.max_corner += obj1.position;
-
     // Teste de colisão com o chão (y=0)
-    if (world_box.min_corner.y < 0.0f) {
+    double minY = position.y + bbox.min_corner.y;
+    if (minY < 0.0) {
         // Ajusta position para que a caixa fique encostada no chão
-        float penetration = -world_box.min_corner.y;
-        obj1.position.y += penetration;
-
-        // Atualiza o objeto homer também
-        homer->position.y += penetration;
-        if (homer->velocity.y < 0)
-            homer->velocity.y = -homer->velocity.y * 0.8;
-
-        // Recalcula a AABB após ajuste
-        world_box.min_corner.y += penetration;
-        world_box.max_corner.y += penetration;
+        position.y -= minY;
+        if (corpos.vy[i] < 0)
+            corpos.vy[i] = -corpos.vy[i] * 0.8;
 
         // Zera a velocidade vertical se muito pequena
-        if (std::abs(homer->velocity.y) < 0.1f) {
-            homer->velocity.y = 0.0;
-            obj1.vy = 0.0f;
-        }
+        if (std::abs(corpos.vy[i]) < 0.1) corpos.vy[i] = 0.0;
     }
-}
-
-bool checkAABBCollision(const AABB& a, const glm::vec3& posA,
-                        const AABB& b, const glm::vec3& posB) {
-    return (a.min_corner.x + posA.x <= b.max_corner.x + posB.x &&
-            a.max_corner.x + posA.x >= b.min_corner.x + posB.x &&
-            a.min_corner.y + posA.y <= b.max_corner.y + posB.y &&
-            a.max_corner.y + posA.y >= b.min_corner.y + posB.y &&
-            a.min_corner.z + posA.z <= b.max_corner.z + posB.z &&
-            a.max_corner.z + posA.z >= b.min_corner.z + posB.z);
+    corpos.setPosition(i, position);
 }
 
 GLuint createVAO(const std::vector<glm::vec3>& vertices, const std::vector<glm::vec3>& normals) {
@@ -246,7 +214,7 @@ AABB computeAABB(const std::vector<glm::vec3>& vertices) {
 
 int main(int argc, char** argv) {
     if (argc < 3) {
-        std::cerr << "Uso: ./render modelo.obj N_objetos\n";
+        std::cerr << "Uso: ./render modelo.obj N_objetos [threads] [sap|grid|todos]\n";
         return -1;
     }
 
@@ -257,6 +225,19 @@ int main(int argc, char** argv) {
         return -1;
     }
 
+    // Número de threads do raycast, 0 usa todos os núcleos
+    unsigned nThreads = (argc > 3) ? static_cast<unsigned>(std::stoi(argv[3])) : 0;
+    setThreadCount(nThreads);
+    std::cout << "Renderizando com " << globalThreadPool().size() << " threads\n";
+
+    // Fase larga da colisão: sweep-and-prune (padrão), grade hash para aglomerados
+    // densos ou todos os pares
+    std::string faseLarga = (argc > 4) ? argv[4] : "sap";
+    if (faseLarga != "sap" && faseLarga != "grid" && faseLarga != "todos") {
+        std::cerr << "Fase larga inválida: " << faseLarga << "\n";
+        return -1;
+    }
+
     if (!glfwInit()) return -1;
     glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -280,36 +261,39 @@ int main(int argc, char** argv) {
         return -1;
     }
 
+    const MeshData& homerMesh = *homer.mesh;
+
     // Calcula a bounding box do modelo
-    AABB bbox = computeAABB(homer.vertices);
+    AABB bbox = computeAABB(homerMesh.vertices);
 
-    // Gera os nObjetos em posições aleatórias ao redor da origem
-    std::vector<PhysicalObject> objetos;
-    std::vector<PhysObj> objboxs;
-    objetos.reserve(nObjetos);
-    objboxs.reserve(nObjetos);
+    // Gera os nObjetos em posições aleatórias ao redor da origem. O estado
+    // físico fica em structure-of-arrays para o tornado rodar em lote
+    RigidBodySoA corpos;
 
-    glm::vec3 mesh_min = homer.vertices[0], mesh_max = homer.vertices[0];
-    for (auto& v : homer.vertices) {
+    glm::vec3 mesh_min = homerMesh.vertices[0], mesh_max = homerMesh.vertices[0];
+    for (auto& v : homerMesh.vertices) {
         mesh_min = glm::min(mesh_min, v);
         mesh_max = glm::max(mesh_max, v);
     }
     AABB bbox_local(mesh_min, mesh_max);
-    PhysObj obj1 { glm::vec3(-3, 23, 0), 0.0f, bbox_local }; 
 
 
     std::default_random_engine rng;
     std::uniform_real_distribution<float> distrib(-10.0f, 10.0f);
 
     for (int i = 0; i < nObjetos; ++i) {
-        PhysicalObject obj = homer;  // Cópia do objeto
+        PhysicalObject obj = homer;  // Cópia do estado, a malha é compartilhada
         obj.position = glm::vec3(distrib(rng), distrib(rng), distrib(rng));
-        PhysObj tbox { obj.position, 0.0f, bbox_local };
-        objetos.push_back(obj);
-        objboxs.push_back(tbox);
+        corpos.add(obj);
     }
 
-    GLuint VAO = createVAO(homer.vertices, homer.normals);
+    // Árvore AABB da malha em espaço local, compartilhada por todos os objetos
+    AABBTree homerTree(Mesh(homerMesh.vertices, homerMesh.triangles), BuildStrategy::SAH);
+    homerTree.build();
+    InstanceTree sceneTree;
+    std::vector<glm::vec3> instancePositions(nObjetos);
+
+    GLuint VAO = createVAO(homerMesh.vertices, homerMesh.normals);
     GLuint shaderProgram = glCreateProgram();
     GLuint vs = compileShader(GL_VERTEX_SHADER, vertex_shader_src);
     GLuint fs = compileShader(GL_FRAGMENT_SHADER, fragment_shader_src);
@@ -330,128 +314,123 @@ int main(int argc, char** argv) {
     // Inicializa objetos físicos
     std::vector<PhysicalObject> físicos(nObjetos);
 
+    // Caixas em espaço de mundo e pares candidatos, reaproveitados entre frames.
+    // A célula da grade é a maior extensão da caixa do modelo, assim cada objeto
+    // ocupa no máximo 2 células por eixo
+    SweepAndPrune broadphase;
+    glm::vec3 extensao = bbox_local.max_corner - bbox_local.min_corner;
+    SpatialHashGrid grade(std::max(extensao.x, std::max(extensao.y, extensao.z)));
+    std::vector<AABB> worldBoxes(nObjetos);
+    std::vector<CollisionPair> pares;
+
+    // Fase estreita: todos os objetos usam a árvore da mesma malha, só muda a posição
+    std::vector<CollisionBody> corposColisao(nObjetos, CollisionBody{&homerTree, {}});
+    std::vector<Contact> contatos;
+
     for (int frame=0; frame < mframe; ++frame) {
 
         std::cout << "Frame " << frame << "\n";
 
+        applyTornado(corpos, origin, dt);
         for (int i = 0; i < nObjetos; ++i) {
-            std::cout << "Caclulate physics obj " << i << "\n";
-            updatePhysics(objboxs[i], dt, &objetos[i]);
-            objetos[i].position = objboxs[i].position;//sincroniza box com objeto
-            // Verifica colisão com todos os outros objetos
-            std::cout << "Checking colision obj " << i << "\n";
-            for (int j = i + 1; j < nObjetos; ++j) {
-                if (checkAABBCollision(objboxs[i].bbox, objetos[i].position,
-                                    objboxs[j].bbox, objetos[j].position)) {
-
-                    // Vetor entre os centros
-                    glm::vec3 dir = objetos[j].position - objetos[i].position;
-                    if (glm::length(dir) < 1e-5f) dir = glm::vec3(1.0f, 0.0f, 0.0f);
-                    dir = glm::normalize(dir);
-
-                    // Reposicionamento leve
-                    float push = 0.05f;
-                    objetos[i].position -= dir * push;
-                    objetos[j].position += dir * push;
-
-                    // Inversão das velocidades como resposta simplificada
-                    std::swap(objetos[i].velocity, objetos[j].velocity);
-                    objboxs[i].position = objetos[i].position;
-                    objboxs[j].position = objetos[j].position;
-                }
+            updatePhysics(corpos, i, bbox_local, dt);
+            glm::vec3 posicao(corpos.position(i));
+            worldBoxes[i] = AABB(bbox_local.min_corner + posicao, bbox_local.max_corner + posicao);
+        }
+
+        // Fase larga: só os pares cujas caixas se sobrepõem chegam à resposta
+        if (faseLarga == "grid") grade.update(worldBoxes, pares);
+        else if (faseLarga == "todos") allPairs(worldBoxes, pares);
+        else broadphase.update(worldBoxes, pares);
+        std::cout << pares.size() << " pares com caixas sobrepostas\n";
+
+        // Fase estreita: só os pares cujos triângulos se tocam têm resposta
+        for (int i = 0; i < nObjetos; ++i) corposColisao[i].transform.position = glm::vec3(corpos.position(i));
+        narrowPhase(corposColisao, pares, contatos);
+
+        // Os contatos vêm agrupados por par; cada par responde pelo seu contato mais profundo
+        size_t emContato = 0;
+        for (size_t k = 0; k < contatos.size();) {
+            unsigned i = contatos[k].body_a, j = contatos[k].body_b;
+            const Contact* maisProfundo = &contatos[k];
+            for (; k < contatos.size() && contatos[k].body_a == i && contatos[k].body_b == j; ++k) {
+                if (contatos[k].depth > maisProfundo->depth) maisProfundo = &contatos[k];
+            }
+            ++emContato;
+
+            // Separa os objetos ao longo da normal (de i para j), metade para cada um
+            glm::dvec3 normal(maisProfundo->normal);
+            double metade = 0.5 * maisProfundo->depth;
+            corpos.setPosition(i, corpos.position(i) - normal * metade);
+            corpos.setPosition(j, corpos.position(j) + normal * metade);
+
+            // Impulso na direção da normal se estão se aproximando, com a mesma
+            // restituição do chão
+            double vRel = glm::dot(corpos.velocity(j) - corpos.velocity(i), normal);
+            if (vRel < 0.0) {
+                double impulso = -(1.0 + 0.8) * vRel / (1.0 / corpos.mass[i] + 1.0 / corpos.mass[j]);
+                corpos.setVelocity(i, corpos.velocity(i) - normal * (impulso / corpos.mass[i]));
+                corpos.setVelocity(j, corpos.velocity(j) + normal * (impulso / corpos.mass[j]));
             }
         }
+        std::cout << emContato << " pares em colisao\n";
 
         glClearColor(0.1f, 0.1f, 0.3f, 1.0f);
-        glm::vec3 hitColor(0.0f);
         std::vector<Pixel> framebuffer(width * height);
 
         std::cout << "Building scene " << "\n";
 
-        glm::mat4 view = glm::lookAt(cameraPos, cameraTarget, cameraUp);
-        float aspect = static_cast<float>(width) / static_cast<float>(height);
-        glm::mat4 projection = glm::perspective(glm::radians(45.0f), aspect, 0.1f, 100.0f);
-        glm::mat4 invViewProj = glm::inverse(projection * view);
-
-        glm::vec3 eye = cameraPos;
-
-        for (int y = 0; y < height; ++y) {
-            for (int x = 0; x < width; ++x) {
-
-                std::cout << "Raycasting pixel (" << x << ", " << y << ")\n";
-
-                // Calcula o raio a partir da posição da câmera
-                float ndcX = (2.0f * x) / width - 1.0f;
-                float ndcY = 1.0f - (2.0f * y) / height;
-                glm::vec4 ndc = glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
-                glm::vec4 worldRay4 = invViewProj * ndc;
-                worldRay4 /= worldRay4.w;
-
-                // Normaliza o vetor de direção do raio
-                float px = (2.0f * (x + 0.5f) / width - 1.0f) * imagePlaneWidth * 0.5f;
-                float py = (1.0f - 2.0f * (y + 0.5f) / height) * imagePlaneHeight * 0.5f;
-                glm::vec3 pixelPos = cameraPos + forward + px * right + py * camUp;
-                glm::vec3 dir = glm::normalize(pixelPos - cameraPos);
-
-                glm::vec3 rayDir = glm::normalize(glm::vec3(worldRay4) - eye);
-                glm::vec3 rayOrigin = eye;
-
-                float minDist = 1e20f;
-
-                // Verifica interseção com o chão
-                float closestT = 1e30f;
-                glm::vec3 hitPoint, hitNormal;
-                Material hitMat = gold;
-                for (int i = 0; i < nObjetos; ++i) {
-                    const auto& obj = objetos[i];
-                    for (size_t j = 0; j < obj.vertices.size(); j += 3) {
-                        // Vértices do triângulo com transformação de posição do objeto
-                        glm::vec3 v0 = obj.vertices[j + 0]     +  glm::vec3(obj.position);
-                        glm::vec3 v1 = obj.vertices[j + 1] +  glm::vec3(obj.position);
-                        glm::vec3 v2 = obj.vertices[j + 2] +  glm::vec3(obj.position);
-
-                        glm::mat4 model1 = glm::translate(glm::mat4(1.0f), glm::vec3(obj.position));
-                        glm::vec3 v0w = glm::vec3(model1 * glm::vec4(v0, 1.0f));
-                        glm::vec3 v1w = glm::vec3(model1 * glm::vec4(v1, 1.0f));
-                        glm::vec3 v2w = glm::vec3(model1 * glm::vec4(v2, 1.0f));
-
-                        glm::vec3 hitPos, normal;
-                        float t, u, v;
-
-                        // Verifica interseção do raio com o triângulo
-                        if (rayTriangleIntersect(cameraPos, dir, v0w, v1w, v2w, t, u, v)) {
-                            if (t < closestT) {
-                                closestT = t;
-                                hitPoint = cameraPos + dir * t;
-
-                                // Normais interpoladas
-                                glm::vec3 n0 = obj.normals[j];
-                                glm::vec3 n1 = obj.normals[j + 1];
-                                glm::vec3 n2 = obj.normals[j + 2];
-                                hitNormal = glm::normalize((1 - u - v) * n0 + u * n1 + v * n2);
-                            }
-                        }
-                        if (closestT < 1e30f) {
-                            hitMat = gold; // ou bronze, ou silver, se quiser variar
-
-                            hitColor = computeColor(hitPoint, hitNormal, lightPos, lightColor, hitMat);
-                            hitColor = glm::clamp(hitColor, 0.0f, 1.0f);
-                        } else {
-                            hitColor = glm::vec3(0.1f, 0.1f, 0.3f); // cor de fundo
-                        }
-
+        // Nível de cima refeito a cada frame sobre as posições novas dos objetos
+        for (int i = 0; i < nObjetos; ++i) instancePositions[i] = glm::vec3(corpos.position(i));
+        sceneTree.build(homerTree, instancePositions);
+
+        // Cada tile escreve só os seus pixels, a imagem é a mesma com qualquer número de threads
+        renderTiles(width, height, DEFAULT_TILE_SIZE, [&](const Tile& tile) {
+            for (int y = tile.y0; y < tile.y1; ++y) {
+                for (int x = tile.x0; x < tile.x1; ++x) {
+                    // Normaliza o vetor de direção do raio
+                    float px = (2.0f * (x + 0.5f) / width - 1.0f) * imagePlaneWidth * 0.5f;
+                    float py = (1.0f - 2.0f * (y + 0.5f) / height) * imagePlaneHeight * 0.5f;
+                    glm::vec3 pixelPos = cameraPos + forward + px * right + py * camUp;
+                    glm::vec3 dir = glm::normalize(pixelPos - cameraPos);
+
+                    float closestT = 1e30f;
+                    glm::vec3 hitPoint, hitNormal;
+                    Material hitMat = gold;
+
+                    // Só os objetos cuja caixa o raio cruza descem até os triângulos
+                    RayHit hit;
+                    if (sceneTree.intersect(cameraPos, dir, hit)) {
+                        const MeshData::triangle_t& ni = homerMesh.normalIndices[hit.face];
+                        closestT = hit.t;
+                        hitPoint = cameraPos + dir * hit.t;
+
+                        // Normais interpoladas
+                        glm::vec3 n0 = homerMesh.normals[ni[0]];
+                        glm::vec3 n1 = homerMesh.normals[ni[1]];
+                        glm::vec3 n2 = homerMesh.normals[ni[2]];
+                        hitNormal = glm::normalize((1 - hit.u - hit.v) * n0 + hit.u * n1 + hit.v * n2);
                     }
-                }
 
+                    glm::vec3 hitColor;
+                    if (closestT < 1e30f) {
+                        hitMat = gold; // ou bronze, ou silver, se quiser variar
+
+                        hitColor = computeColor(hitPoint, hitNormal, lightPos, lightColor, hitMat);
+                        hitColor = glm::clamp(hitColor, 0.0f, 1.0f);
+                    } else {
+                        hitColor = glm::vec3(0.1f, 0.1f, 0.3f); // cor de fundo
+                    }
 
-                hitColor = glm::clamp(hitColor, 0.0f, 1.0f);
-                framebuffer[y * width + x] = {
-                    static_cast<unsigned char>(hitColor.r * 255),
-                    static_cast<unsigned char>(hitColor.g * 255),
-                    static_cast<unsigned char>(hitColor.b * 255)
-                };
+                    hitColor = glm::clamp(hitColor, 0.0f, 1.0f);
+                    framebuffer[y * width + x] = {
+                        static_cast<unsigned char>(hitColor.r * 255),
+                        static_cast<unsigned char>(hitColor.g * 255),
+                        static_cast<unsigned char>(hitColor.b * 255)
+                    };
+                }
             }
-        }
+        });
 
         std::cout << "Saving..." << "\n";
         // Salvar imagem
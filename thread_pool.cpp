@@ -0,0 +1,178 @@
+#include "hpp/thread_pool.hpp"
+
+#include <algorithm>
+
+namespace
+{
+    // Set while a thread runs a task, nested run() calls go serial
+    thread_local bool inside_task = false;
+
+    std::uint64_t packRange(unsigned begin, unsigned end)
+    {
+        return (static_cast<std::uint64_t>(begin) << 32) | end;
+    }
+
+    unsigned rangeBegin(std::uint64_t range) { return static_cast<unsigned>(range >> 32); }
+    unsigned rangeEnd(std::uint64_t range) { return static_cast<unsigned>(range & 0xffffffffu); }
+
+    std::unique_ptr<ThreadPool>& globalPoolStorage()
+    {
+        static std::unique_ptr<ThreadPool> pool;
+        return pool;
+    }
+}
+
+ThreadPool::ThreadPool(unsigned threads)
+{
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+    slices = std::make_unique<Slice[]>(threads);
+    workers.reserve(threads - 1);
+    for (unsigned t = 1; t < threads; ++t) {
+        workers.emplace_back(&ThreadPool::workerLoop, this, t);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers) worker.join();
+}
+
+void ThreadPool::run(unsigned count, const std::function<void(unsigned)>& task)
+{
+    if (count == 0) return;
+
+    if (inside_task || workers.empty() || count == 1) {
+        for (unsigned i = 0; i < count; ++i) task(i);
+        return;
+    }
+
+    // One contiguous slice per thread, the caller is thread 0
+    unsigned threads = size();
+    for (unsigned t = 0; t < threads; ++t) {
+        unsigned begin = static_cast<unsigned>(static_cast<std::uint64_t>(count) * t / threads);
+        unsigned end = static_cast<unsigned>(static_cast<std::uint64_t>(count) * (t + 1) / threads);
+        slices[t].range.store(packRange(begin, end), std::memory_order_relaxed);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &task;
+        busy = static_cast<unsigned>(workers.size());
+        ++generation;
+    }
+    wake.notify_all();
+
+    work(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this] { return busy == 0; });
+    job = nullptr;
+}
+
+void ThreadPool::workerLoop(unsigned thread)
+{
+    unsigned seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+        }
+
+        work(thread);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busy == 0) finished.notify_one();
+    }
+}
+
+// Runs tasks from the thread's own slice, then from the other slices
+void ThreadPool::work(unsigned thread)
+{
+    inside_task = true;
+    unsigned task;
+    while (popTask(thread, task) || stealTask(thread, task)) {
+        (*job)(task);
+    }
+    inside_task = false;
+}
+
+// Takes the first task of the thread's own slice
+bool ThreadPool::popTask(unsigned thread, unsigned& task)
+{
+    std::atomic<std::uint64_t>& range = slices[thread].range;
+    std::uint64_t current = range.load(std::memory_order_acquire);
+    while (true) {
+        unsigned begin = rangeBegin(current), end = rangeEnd(current);
+        if (begin >= end) return false;
+        if (range.compare_exchange_weak(current, packRange(begin + 1, end),
+                                        std::memory_order_acq_rel)) {
+            task = begin;
+            return true;
+        }
+    }
+}
+
+// Takes the back half of another thread's slice, keeps one task to run now
+// and moves the rest into this thread's (empty) slice
+bool ThreadPool::stealTask(unsigned thread, unsigned& task)
+{
+    unsigned threads = size();
+    for (unsigned offset = 1; offset < threads; ++offset) {
+        std::atomic<std::uint64_t>& victim = slices[(thread + offset) % threads].range;
+        std::uint64_t current = victim.load(std::memory_order_acquire);
+        while (true) {
+            unsigned begin = rangeBegin(current), end = rangeEnd(current);
+            if (begin >= end) break;
+
+            unsigned middle = begin + (end - begin) / 2; // Victim keeps [begin, middle)
+            if (victim.compare_exchange_weak(current, packRange(begin, middle),
+                                             std::memory_order_acq_rel)) {
+                task = middle;
+                slices[thread].range.store(packRange(middle + 1, end), std::memory_order_release);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+ThreadPool& globalThreadPool()
+{
+    auto& pool = globalPoolStorage();
+    if (!pool) pool = std::make_unique<ThreadPool>();
+    return *pool;
+}
+
+void setThreadCount(unsigned threads)
+{
+    auto& pool = globalPoolStorage();
+    pool.reset();
+    pool = std::make_unique<ThreadPool>(threads);
+}
+
+void parallelFor(std::size_t count, std::size_t grain, RangeBody body)
+{
+    if (count == 0) return;
+    grain = std::max<std::size_t>(grain, 1);
+    std::size_t chunks = (count + grain - 1) / grain;
+
+    // A task capturing a single pointer fits in std::function's local storage,
+    // so posting the job does not allocate either
+    struct Range
+    {
+        std::size_t count, grain;
+        RangeBody body;
+    } range{count, grain, body};
+    globalThreadPool().run(static_cast<unsigned>(chunks), [&range](unsigned chunk) {
+        std::size_t begin = chunk * range.grain;
+        range.body(begin, std::min(range.count, begin + range.grain));
+    });
+}
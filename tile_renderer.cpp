@@ -0,0 +1,26 @@
+#include "hpp/tile_renderer.hpp"
+#include "hpp/thread_pool.hpp"
+
+#include <algorithm>
+
+void renderTiles(int width, int height, int tileSize,
+                 const std::function<void(const Tile&)>& renderTile) {
+    if (width <= 0 || height <= 0) return;
+    if (tileSize <= 0) tileSize = DEFAULT_TILE_SIZE;
+
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+
+    // Os tiles são distribuídos pelo pool com roubo de trabalho,
+    // tiles caros (muitos triângulos) não seguram as outras threads
+    globalThreadPool().run(static_cast<unsigned>(tilesX * tilesY), [&](unsigned i) {
+        int tx = static_cast<int>(i) % tilesX;
+        int ty = static_cast<int>(i) / tilesX;
+        Tile tile;
+        tile.x0 = tx * tileSize;
+        tile.y0 = ty * tileSize;
+        tile.x1 = std::min(tile.x0 + tileSize, width);
+        tile.y1 = std::min(tile.y0 + tileSize, height);
+        renderTile(tile);
+    });
+}